@@ -21,21 +21,1009 @@
 // - access global results with count_pass(), count_fail() and summary().
 // - alternatively the tests can be written more naturally with
 //   test("id").expect_XX(test) instead of test.expect_XX("id", test)
+// - in deferred mode, the expect_* methods queue the tests instead, and run()
+//   executes them on several threads. The output of each test stays grouped.
+//   The queued tests can be grouped in suites, listed with list() without
+//   running them, and ordered with order().
+// - expect_true(), expect_false(), expect_value() and expect_in_range() also
+//   take callables returning a std::future. These tests run concurrently, and
+//   their results are recorded by wait_async(), run() or summary().
+//   Including UnitTesterCoroutines.hpp, which requires C++20, adds awaitables
+//   such as coroutine tasks.
+// - fixture() creates a value shared by the tests which capture it, built on
+//   first use and destroyed after the last of them has run.
+// - with timing(true), the duration of each test is recorded, and summary()
+//   reports the slowest tests.
+// - benchmark() measures the time per call of a callable, and
+//   expect_faster_than() turns such a measure into a test.
+// - expect_percentile_below() checks the tail latency of a callable, measured
+//   call by call into a LatencyHistogram, in closed or open loop.
+// - expect_no_regression() compares a benchmark to a baseline loaded with
+//   load_baseline(), and save_baseline() stores the benchmarks of this run.
+// - benchmark_sweep() measures a parallel callable over a grid of input sizes
+//   and thread counts, and expect_scaling() checks its parallel efficiency.
+// - results are given to a Reporter as each test completes, by default one
+//   printing them to the std::ostream of the UnitTester. With batch_size(),
+//   they are buffered and given in batches instead. Call flush() before
+//   writing directly to that stream then.
+// - values are formatted only when a test fails, by UnitTester::Formatter,
+//   which can be specialized for the types of the program. Types without
+//   operator<< are accepted.
+// - ids are taken as std::string_view, so string literals cost no allocation.
+//   With intern_ids(true), each distinct id is also stored only once.
+// - the expect_* methods must all be called from the same thread.
+// - only_matching() selects tests with glob patterns, compiled once.
+// - shard() or the environment variables UNIT_TESTER_SHARD_INDEX and
+//   UNIT_TESTER_TOTAL_SHARDS split the tests of a program across machines.
+// - results_cache() keeps the results of the previous run in a file, so that
+//   rerun() can run its failed tests first or only. fail_fast() stops a run
+//   after some failures.
+// - expect_constexpr() evaluates a constexpr callable at compile time, so
+//   that only its result is recorded when the tests run.
+// - expect_all() checks a function over a whole range of inputs as one test.
+// - expect_property() checks a predicate on random inputs, and shrinks a
+//   failing input to a small counterexample.
+// - expect_stress() runs a body on several threads at once, many times, and
+//   checks the shared object afterwards. expect_linearizable() checks the
+//   histories of concurrent operations against a sequential model.
+// - expect_all_close() and expect_all_close_ulp() compare arrays of floating
+//   point values with a tolerance.
+// - expect_matches_golden() compares the output written by a producer to a
+//   golden file as it is written, without storing it, and update_goldens(true)
+//   rewrites the golden files instead. On POSIX systems, including
+//   UnitTesterMapping.hpp compares with the golden files mapped in memory.
+// - on POSIX systems, including UnitTesterIsolation.hpp provides run_isolated(),
+//   which runs the queued tests in worker processes, surviving crashes.
+// - timeout() limits the duration of each test, and test("id").timeout(d) the
+//   duration of one test. The tests over their limit fail, and a watchdog
+//   thread aborts the run when a test misses its limit, so that a test looping
+//   forever cannot hang it, unless abort_on_timeout(false) is set.
+// - including UnitTesterAllocations.hpp in one source file of the program
+//   counts heap allocations and the bytes in use, for expect_no_alloc(),
+//   expect_max_alloc(), expect_peak_memory_below() and track_allocations().
+// - on Linux, including UnitTesterCounters.hpp reads hardware performance
+//   counters around test callables, for expect_max_instructions() and
+//   hardware_counters().
+// - on POSIX systems, including UnitTesterProfiler.hpp samples the stacks of
+//   the tests selected by profile(), and save_profiles() writes them for flame
+//   graph tools.
+// - UnitTesterReporters.hpp provides reporters writing JUnit XML, JSON Lines
+//   and TAP, for continuous integration tools.
+// - UnitTesterSelfBenchmark.hpp measures the overhead of UnitTester itself,
+//   against a baseline.
+
+#pragma once
 
 #include <iostream>
+#include <iterator>
+#include <sstream>
 #include <exception>
 #include <functional>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <chrono>
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <type_traits>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <fstream>
+#include <unordered_map>
+#include <string_view>
+#include <memory>
+#include <future>
+#include <iomanip>
+#include <optional>
+#include <utility>
 
 class UnitTester
 {
+  public:
+    // Time spent in the callable of one test.
+    // The CPU time is the CPU time of the thread running the test when
+    // UnitTesterCounters.hpp is included, else of the whole process. It is
+    // then unknown for the tests run in parallel by run(), since it would
+    // include the other threads.
+    struct TestTiming {
+      std::string id;
+      std::chrono::nanoseconds wall_time;
+      std::optional<std::chrono::nanoseconds> cpu_time;
+    };
+
+    // Result of a benchmark. The samples are the average times per iteration,
+    // in nanoseconds, of each batch of iterations, sorted in increasing order.
+    // They are empty if the benchmark was skipped or interrupted by an exception.
+    struct BenchmarkResult {
+      std::string id;
+      uintmax_t iterations;
+      double mean_ns;
+      double median_ns;
+      double p99_ns;
+      std::vector<double> samples_ns;
+    };
+
+    // Histogram of latencies in nanoseconds, in the manner of HdrHistogram: the
+    // values below 128 have their own bucket, and each power of two above is
+    // split in 64 buckets, so a value is known within 1/64 of itself, up to the
+    // largest uint64_t, in a fixed 30 KB. Recording a value costs a few
+    // operations and no allocation.
+    class LatencyHistogram {
+      private:
+        static constexpr unsigned sub_bits = 7;
+        static constexpr uint64_t sub_count = uint64_t(1) << sub_bits;
+        static constexpr uint64_t half_count = sub_count / 2;
+        static constexpr std::size_t n_buckets = (64 - sub_bits + 1) * half_count + half_count;
+
+        std::vector<uint64_t> counts_;
+        uint64_t total_;
+        uint64_t min_;
+        uint64_t max_;
+        double sum_;
+
+        static std::size_t index_of_(uint64_t v) {
+          if (v < sub_count) return static_cast<std::size_t>(v);
+          // The shift bringing v in [half_count, sub_count)
+          unsigned shift = 0;
+          for (unsigned step = 32; step > 0; step /= 2) {
+            if ((v >> (shift + step)) >= half_count) shift += step;
+          }
+          return static_cast<std::size_t>(shift * half_count + (v >> shift));
+        }
+
+        // Largest value in a bucket
+        static uint64_t highest_of_(std::size_t index) {
+          if (index < sub_count) return index;
+          uint64_t shift = index / half_count - 1;
+          uint64_t q = index - shift * half_count;
+          return ((q + 1) << shift) - 1;
+        }
+
+      public:
+        LatencyHistogram() : counts_(n_buckets, 0), total_(0), min_(std::numeric_limits<uint64_t>::max()), max_(0), sum_(0) { }
+
+        /** Record a latency. */
+        void record(uint64_t ns) {
+          ++counts_[index_of_(ns)];
+          ++total_;
+          min_ = std::min(min_, ns);
+          max_ = std::max(max_, ns);
+          sum_ += static_cast<double>(ns);
+        }
+
+        void reset() {
+          std::fill(counts_.begin(), counts_.end(), 0);
+          total_ = 0;
+          min_ = std::numeric_limits<uint64_t>::max();
+          max_ = 0;
+          sum_ = 0;
+        }
+
+        uint64_t count() const { return total_; }
+        uint64_t min() const { return total_ ? min_ : 0; }
+        uint64_t max() const { return max_; }
+        double mean() const { return total_ ? sum_ / static_cast<double>(total_) : 0; }
+
+        /** Returns the latency at the given percentile, for instance 0.99: at least
+         * this fraction of the values recorded are at most the latency returned.
+         * It is the largest value of its bucket, and at most max(). */
+        uint64_t percentile(double fraction) const {
+          if (total_ == 0) return 0;
+          double rank = std::ceil(std::min(std::max(fraction, 0.0), 1.0) * static_cast<double>(total_));
+          uint64_t needed = std::max<uint64_t>(1, static_cast<uint64_t>(rank));
+          uint64_t seen = 0;
+          for (std::size_t i = 0; i < n_buckets; ++i) {
+            seen += counts_[i];
+            if (seen >= needed) return std::min(highest_of_(i), max_);
+          }
+          return max_;
+        }
+    };
+
+    // One point of a scalability sweep: the median time of the work on an input
+    // of the given size, shared by the given number of threads, the items of the
+    // input processed per second, and the parallel efficiency relative to the
+    // fewest threads measured on this size, 1 when the speedup is perfect.
+    struct SweepPoint {
+      std::size_t size;
+      unsigned threads;
+      double time_ns;
+      double throughput;
+      double efficiency;
+    };
+
+    // Result of benchmark_sweep(), with the points in increasing order of size,
+    // then of threads. The complexity is the model best fitting the times with
+    // the fewest threads, like "O(n log n)", or is empty with less than 3 sizes.
+    // The points are empty if the sweep was skipped or interrupted.
+    struct SweepResult {
+      std::string id;
+      std::vector<SweepPoint> points;
+      std::string complexity;
+    };
+
+    // Heap allocations made by the callable of one test, on the thread running
+    // it. The peak is the most bytes in use at once during the callable, beyond
+    // those in use when it started.
+    struct TestAllocations {
+      std::string id;
+      uint64_t count;
+      uint64_t bytes;
+      uint64_t peak_bytes;
+    };
+
+    // The replacement of operator new counting allocations. Defined in
+    // UnitTesterAllocations.hpp.
+    class AllocationHook;
+
+    // Hardware events counted during the callable of one test, on the thread
+    // running it. Events the processor cannot count are 0.
+    struct TestCounters {
+      std::string id;
+      uint64_t instructions;
+      uint64_t cycles;
+      uint64_t cache_misses;
+      uint64_t branch_misses;
+    };
+
+    // The reader of hardware performance counters. Defined in UnitTesterCounters.hpp.
+    class CounterHook;
+
+    // The adapter of awaitables to std::future. Defined in UnitTesterCoroutines.hpp.
+    class AwaitableHook;
+
+    // The mapping of golden files in memory. Defined in UnitTesterMapping.hpp.
+    class MappingHook;
+
+    // The sampler of the stacks of profiled tests. Defined in UnitTesterProfiler.hpp.
+    class ProfilerHook;
+
+    // Benchmarks of the overhead of UnitTester. Defined in UnitTesterSelfBenchmark.hpp.
+    class SelfBenchmark;
+
+    // skip is the status of a test which ran but could not check what it expects
+    enum class Status : uint8_t { pass, fail, benchmark, skip };
+
+    // Which tests run, according to the results of the previous run. See rerun().
+    enum class Rerun { all, failed_first, failed_only };
+
+    // Order in which run() and run_isolated() start the queued tests. See order().
+    enum class Order { queued, longest_first, by_suite };
+
+    // Compact record of the result of a test. The message is stored in the text
+    // of the batch holding the record, at the given offset. The id is either
+    // interned, with a non-zero handle, or stored in the text like the message.
+    // The duration is 0 unless timing is enabled.
+    struct TestRecord {
+      uint32_t id;
+      uint32_t id_size;
+      uint32_t message;
+      uint32_t message_size;
+      int64_t duration_ns;
+      uint32_t handle;
+      Status status;
+    };
+
+    // A batch of results, only valid during the call to Reporter::report()
+    struct ResultBatch {
+      std::vector<TestRecord> const& records;
+      std::string const& text;
+      std::deque<std::string> const& interned;
+      std::string_view id(TestRecord const& r) const {
+        return r.handle ? std::string_view(interned[r.handle - 1]) : std::string_view(text.data() + r.id, r.id_size);
+      }
+      std::string_view message(TestRecord const& r) const {
+        return std::string_view(text.data() + r.message, r.message_size);
+      }
+    };
+
+    // Receives the results of tests in batches. A reporter is never called
+    // concurrently, even when tests run in parallel, but the records of tests
+    // running on different threads arrive in different batches.
+    class Reporter {
+      public:
+        virtual ~Reporter() { }
+        virtual void report(ResultBatch const& batch) = 0;
+        virtual void flush() { }
+    };
+
+    // Reporters writing JUnit XML, JSON Lines and TAP as the results arrive.
+    // Defined in UnitTesterReporters.hpp.
+    class JUnitReporter;
+    class JsonLinesReporter;
+    class TapReporter;
+
+    // Handle to a value shared read-only by several tests, created by
+    // UnitTester::fixture(). The value is built by the factory on the first call
+    // to get(), by any thread, and destroyed with the last copy of the handle.
+    // If the factory throws, every call to get() throws the same exception,
+    // without building the value again.
+    template <typename T>
+    class Fixture {
+      private:
+        struct state {
+          std::function<T()> make;
+          std::once_flag once;
+          std::unique_ptr<T const> value;
+          std::exception_ptr error;
+        };
+        std::shared_ptr<state> state_;
+
+      public:
+        template <typename Make>
+        explicit Fixture(Make make) : state_(std::make_shared<state>()) { state_->make = std::move(make); }
+
+        T const& get() const {
+          state& s = *state_;
+          std::call_once(s.once, [&s] {
+            try {
+              s.value.reset(new T(s.make()));
+            } catch (...) {
+              s.error = std::current_exception();
+            }
+            // Releases what the factory holds, which is not needed anymore
+            s.make = nullptr;
+          });
+          if (s.error) std::rethrow_exception(s.error);
+          return *s.value;
+        }
+        T const& operator*() const { return get(); }
+        T const* operator->() const { return &get(); }
+    };
+
+    // Fast pseudo-random generator given to the generators of expect_property():
+    // xoshiro256**, seeded with splitmix64. Generators must draw all their
+    // randomness from it, so that a failing input can be regenerated and shrunk
+    // by replaying smaller draws. Smaller draws give smaller values, so inputs
+    // shrink towards the lower bound of ranges, false, and short sequences.
+    class Random {
+      private:
+        friend class UnitTester;
+        uint64_t s_[4];
+        // Draws recorded for shrinking, or replayed instead of generated
+        std::vector<uint64_t>* record_;
+        std::vector<uint64_t> const* replay_;
+        std::size_t position_;
+
+        static uint64_t rotl_(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+        // High 64 bits of the 128 bits product of a and b
+        static uint64_t mul_high_(uint64_t a, uint64_t b) {
+          uint64_t a_lo = a & 0xffffffffu, a_hi = a >> 32, b_lo = b & 0xffffffffu, b_hi = b >> 32;
+          uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi;
+          uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffffu) + lo_hi;
+          return a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+        }
+
+      public:
+        explicit Random(uint64_t seed) : s_(), record_(nullptr), replay_(nullptr), position_(0) { this->seed(seed); }
+
+        void seed(uint64_t seed) {
+          for (uint64_t& s : s_) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            s = z ^ (z >> 31);
+          }
+        }
+
+        /** Returns 64 random bits. */
+        uint64_t next() {
+          if (replay_) return position_ < replay_->size() ? (*replay_)[position_++] : 0;
+          uint64_t result = rotl_(s_[1] * 5, 7) * 9;
+          uint64_t t = s_[1] << 17;
+          s_[2] ^= s_[0];
+          s_[3] ^= s_[1];
+          s_[1] ^= s_[2];
+          s_[0] ^= s_[3];
+          s_[2] ^= t;
+          s_[3] = rotl_(s_[3], 45);
+          if (record_) record_->push_back(result);
+          return result;
+        }
+
+        /** Returns a number in [0, n), for n > 0, by multiplying and shifting,
+         * with a bias below n / 2^64. */
+        uint64_t below(uint64_t n) { return mul_high_(next(), n); }
+
+        /** Returns an integer in [min, max]. */
+        template <typename Int>
+        Int in_range(Int min, Int max) {
+          static_assert(std::is_integral_v<Int>, "in_range() takes integers");
+          using U = std::make_unsigned_t<Int>;
+          uint64_t span = static_cast<uint64_t>(static_cast<U>(static_cast<U>(max) - static_cast<U>(min)));
+          uint64_t r = (span == std::numeric_limits<uint64_t>::max()) ? next() : below(span + 1);
+          return static_cast<Int>(static_cast<U>(static_cast<U>(min) + static_cast<U>(r)));
+        }
+
+        /** Returns a double in [0, 1). */
+        double uniform() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+        /** Returns a double in [min, max). */
+        double uniform(double min, double max) { return min + (max - min) * uniform(); }
+        /** Returns true with probability 1/2. */
+        bool coin() { return (next() >> 63) != 0; }
+    };
+
+    // Formats the values of failing tests, and only those: passing tests never
+    // format anything. By default, values are written with operator<<, strings
+    // and ranges are truncated, booleans are written as true or false, and other
+    // types as "(value not printable)". Specialize it to format a type of the
+    // program, for instance:
+    //     template <> struct UnitTester::Formatter<Point> {
+    //       static void format(std::ostream& os, Point const& p) { os << '(' << p.x << ", " << p.y << ')'; }
+    //     };
+    // The second parameter allows partial specializations with std::enable_if_t.
+    template <typename T, typename = void>
+    struct Formatter {
+      static void format(std::ostream& os, T const& value) {
+        if constexpr (std::is_same_v<T, bool>) {
+          os << (value ? "true" : "false");
+        } else if constexpr (std::is_convertible_v<T const&, std::string_view>) {
+          std::string_view text = value;
+          if (text.size() <= max_formatted_characters_) {
+            os << text;
+          } else {
+            os << text.substr(0, max_formatted_characters_) << "... (" << text.size() << " characters)";
+          }
+        } else if constexpr (is_printable_<T>::value) {
+          os << value;
+        } else if constexpr (std::is_enum_v<T>) {
+          os << +static_cast<std::underlying_type_t<T>>(value);
+        } else if constexpr (is_range_<T>::value) {
+          std::size_t count = 0;
+          os << '{';
+          for (auto const& element : value) {
+            if (count == max_formatted_elements_) os << ", ...";
+            if (count++ >= max_formatted_elements_) continue;
+            if (count > 1) os << ", ";
+            os << formatted_(element);
+          }
+          os << '}';
+          if (count > max_formatted_elements_) os << " (" << count << " elements)";
+        } else {
+          os << "(value not printable)";
+        }
+      }
+    };
+
+    // Tells whether the callables of tests returning a Result are asynchronous,
+    // and if so, how to get a std::future of their value. Specialize it for other
+    // asynchronous types, with is_async true and a start(Result) function.
+    template <typename Result, typename = void>
+    struct AsyncResult {
+      static constexpr bool is_async = false;
+    };
+    template <typename T>
+    struct AsyncResult<std::future<T>> {
+      static constexpr bool is_async = true;
+      static std::future<T> start(std::future<T> f) { return f; }
+    };
+    template <typename T>
+    struct AsyncResult<std::shared_future<T>> {
+      static constexpr bool is_async = true;
+      static std::shared_future<T> start(std::shared_future<T> f) { return f; }
+    };
+
   private:
+    // Id of a test: its text, and its handle if it is interned, or 0
+    struct test_id {
+      std::string_view text;
+      uint32_t handle;
+    };
+
+    // Id of a queued test, with a copy of its text unless it is interned
+    struct queued_id {
+      std::string storage;
+      test_id id;
+      queued_id(test_id i) : storage(i.handle ? std::string() : std::string(i.text)), id(i) { }
+      test_id get() const { return id.handle ? id : test_id { storage, 0 }; }
+    };
+
+    // Set of glob patterns, where '*' matches any sequence and '?' any character.
+    // Patterns which are literal or end with the only '*' are stored in a trie,
+    // so matching an id against all of them is linear in the length of the id.
+    // Other patterns are matched one by one.
+    class pattern_set {
+      private:
+        struct trie_node {
+          std::vector<std::pair<char, uint32_t>> next;
+          bool exact;
+          bool prefix;
+        };
+        std::vector<trie_node> trie_;
+        std::vector<std::string> globs_;
+
+        static bool glob_match_(std::string_view pattern, std::string_view text) {
+          std::size_t p = 0, t = 0;
+          std::size_t star = std::string_view::npos, star_t = 0;
+          while (t < text.size()) {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+              ++p;
+              ++t;
+            } else if (p < pattern.size() && pattern[p] == '*') {
+              star = p++;
+              star_t = t;
+            } else if (star != std::string_view::npos) {
+              p = star + 1;
+              t = ++star_t;
+            } else {
+              return false;
+            }
+          }
+          while (p < pattern.size() && pattern[p] == '*') ++p;
+          return p == pattern.size();
+        }
+
+      public:
+        pattern_set() : trie_(1, trie_node { {}, false, false }), globs_() { }
+
+        bool empty() const { return globs_.empty() && trie_.size() == 1 && !trie_[0].exact && !trie_[0].prefix; }
+
+        void add(std::string_view pattern) {
+          std::size_t wildcard = pattern.find_first_of("*?");
+          bool prefix = (wildcard == pattern.size() - 1 && pattern[wildcard] == '*');
+          if (wildcard != std::string_view::npos && !prefix) {
+            globs_.emplace_back(pattern);
+            return;
+          }
+          if (prefix) pattern.remove_suffix(1);
+          uint32_t node = 0;
+          for (char c : pattern) {
+            auto& next = trie_[node].next;
+            auto edge = std::find_if(next.begin(), next.end(),
+              [c](std::pair<char, uint32_t> const& e) { return e.first == c; });
+            if (edge != next.end()) {
+              node = edge->second;
+            } else {
+              uint32_t child = static_cast<uint32_t>(trie_.size());
+              next.emplace_back(c, child);
+              trie_.push_back(trie_node { {}, false, false });
+              node = child;
+            }
+          }
+          (prefix ? trie_[node].prefix : trie_[node].exact) = true;
+        }
+
+        bool matches(std::string_view id) const {
+          uint32_t node = 0;
+          std::size_t i = 0;
+          for (;;) {
+            trie_node const& n = trie_[node];
+            if (n.prefix || (n.exact && i == id.size())) return true;
+            if (i == id.size()) break;
+            char c = id[i++];
+            auto edge = std::find_if(n.next.begin(), n.next.end(),
+              [c](std::pair<char, uint32_t> const& e) { return e.first == c; });
+            if (edge == n.next.end()) break;
+            node = edge->second;
+          }
+          for (auto const& glob : globs_) {
+            if (glob_match_(glob, id)) return true;
+          }
+          return false;
+        }
+    };
+
+    // Allocations counted by AllocationHook for each thread, and whether the
+    // hook is installed at all. The bytes allocated by a thread and freed by
+    // another one make the live bytes of the first too high, and of the second
+    // too low, possibly negative.
+    struct allocation_count {
+      uint64_t count;
+      uint64_t bytes;
+    };
+    struct heap_usage {
+      int64_t live;
+      int64_t peak;
+    };
+    static inline thread_local allocation_count thread_allocations_ { 0, 0 };
+    static inline thread_local heap_usage thread_heap_ { 0, 0 };
+    static inline std::atomic<bool> allocations_counted_ { false };
+    // Reads the resident set size of the process, or returns false if it is not
+    // available. Set by CounterHook, null if UnitTesterCounters.hpp is not included.
+    static inline bool (*rss_reader_)(uint64_t&) = nullptr;
+    // Reads the CPU time used by the calling thread, or returns false if it is
+    // not available. Set by CounterHook, null if UnitTesterCounters.hpp is not included.
+    static inline bool (*thread_cpu_reader_)(std::chrono::nanoseconds&) = nullptr;
+
+    // Non-owning reference to a callable, called through a function pointer, so
+    // that the functions taking it are compiled once for all the callables of
+    // the tests, instead of once for each of them. The callable must outlive it.
+    template <typename Signature>
+    class callable_ref;
+
+    template <typename R, typename... Args>
+    class callable_ref<R(Args...)> {
+      private:
+        void* callable_;
+        R (*call_)(void*, Args...);
+      public:
+        template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, callable_ref>>>
+        callable_ref(F&& f)
+        : callable_(const_cast<void*>(static_cast<void const*>(std::addressof(f)))),
+          call_([](void* callable, Args... args) -> R {
+            return static_cast<R>((*static_cast<std::remove_reference_t<F>*>(callable))(std::forward<Args>(args)...));
+          })
+        { }
+        R operator()(Args... args) const { return call_(callable_, std::forward<Args>(args)...); }
+    };
+
+    // Hardware events counted on the calling thread since it started counting
+    struct counter_values {
+      uint64_t instructions;
+      uint64_t cycles;
+      uint64_t cache_misses;
+      uint64_t branch_misses;
+    };
+    // Reads the counters of the calling thread, or returns false if they are not
+    // available. Set by CounterHook, null if UnitTesterCounters.hpp is not included.
+    static inline bool (*counter_reader_)(counter_values&) = nullptr;
+
+    // Starts sampling the stack of the calling thread every interval of CPU
+    // time, or returns false if it cannot. The samples are kept for a test
+    // expected to last about duration, and only the frames below base, an
+    // object of the caller of the test, are sampled. Stopping calls
+    // add(stack, samples) for each distinct stack sampled since the start, with
+    // its frames from the outermost separated by ';'. Set by ProfilerHook, null
+    // if UnitTesterProfiler.hpp is not included.
+    static inline bool (*profiler_start_)(std::chrono::nanoseconds interval, std::chrono::nanoseconds duration,
+                                          void const* base) = nullptr;
+    static inline void (*profiler_stop_)(callable_ref<void(std::string_view, uint64_t)> add) = nullptr;
+
+    // A file mapped in memory, unmapped by calling unmap(data, size) if not null
+    struct mapped_file {
+      char const* data;
+      uint64_t size;
+      void (*unmap)(char const*, uint64_t);
+    };
+    // Maps a whole file read-only, or returns false. Set by MappingHook, null if
+    // UnitTesterMapping.hpp is not included.
+    static inline bool (*file_mapper_)(std::string const&, mapped_file&) = nullptr;
+
+    // Stream buffer appending everything to a std::string
+    class string_appender : public std::streambuf {
+      private:
+        std::string& text_;
+      protected:
+        int_type overflow(int_type c) override {
+          if (!traits_type::eq_int_type(c, traits_type::eof())) text_.push_back(traits_type::to_char_type(c));
+          return traits_type::not_eof(c);
+        }
+        std::streamsize xsputn(char const* s, std::streamsize n) override {
+          text_.append(s, static_cast<std::size_t>(n));
+          return n;
+        }
+      public:
+        string_appender(std::string& text) : text_(text) { }
+    };
+
+    // Preallocated buffer of the results of the tests run by one thread.
+    // The message of a result is everything written to message() until the
+    // next result is added. The results are given to the reporter when the
+    // buffer is full or flushed, between two tests. With a capacity of 0, they
+    // are given to it as soon as the call recording them completes.
+    class result_buffer {
+      private:
+        UnitTester& tester_;
+        std::size_t capacity_;
+        std::vector<TestRecord> records_;
+        std::string text_;
+        string_appender appender_;
+        std::ostream message_;
+        std::ostream discard_;
+        int64_t duration_ns_;
+        // Time limit of the tests recorded in this buffer, 0 for none
+        std::chrono::nanoseconds timeout_;
+        // Deadline of the running test in nanoseconds of the steady clock, read
+        // by the watchdog. 0 when there is none, -1 once the watchdog has taken
+        // over the buffer to abort the run.
+        std::atomic<int64_t> deadline_;
+        std::chrono::steady_clock::time_point started_;
+        test_id running_;
+        bool watched_;
+        // Duration of the last test if it missed its deadline, else 0
+        std::chrono::nanoseconds overdue_;
+
+        // Ends the message of the last result
+        void close_() {
+          if (!records_.empty()) {
+            TestRecord& r = records_.back();
+            r.message_size = static_cast<uint32_t>(text_.size() - r.message);
+          }
+        }
+
+      public:
+        result_buffer(UnitTester& tester, std::size_t capacity)
+        : tester_(tester), capacity_(capacity), records_(), text_(), appender_(text_), message_(&appender_),
+          discard_(nullptr), duration_ns_(0), timeout_(0), deadline_(0), started_(), running_(), watched_(false),
+          overdue_(0)
+        {
+          records_.reserve(std::max<std::size_t>(capacity_, 1));
+          text_.reserve(std::max<std::size_t>(capacity_, 1) * 64);
+          message_.copyfmt(tester_.out_);
+        }
+
+        ~result_buffer() {
+          if (watched_) {
+            std::lock_guard<std::mutex> lock(tester_.watch_mutex_);
+            auto& watched = tester_.watched_;
+            watched.erase(std::remove(watched.begin(), watched.end(), this), watched.end());
+          }
+        }
+
+        // Adds a result and returns the stream where its message can be written
+        std::ostream& add(test_id id, Status status) {
+          close_();
+          if (records_.size() >= capacity_) {
+            // The format of the message may already be set by the test
+            local_iostream_flags f(message_);
+            flush();
+          }
+          TestRecord r;
+          r.id = static_cast<uint32_t>(text_.size());
+          r.id_size = 0;
+          r.handle = id.handle;
+          if (!id.handle) {
+            r.id_size = static_cast<uint32_t>(id.text.size());
+            text_.append(id.text);
+          }
+          r.message = static_cast<uint32_t>(text_.size());
+          r.message_size = 0;
+          r.duration_ns = duration_ns_;
+          r.status = status;
+          records_.push_back(r);
+          duration_ns_ = 0;
+          return message_;
+        }
+
+        // Drops a result nobody will see, and returns a stream ignoring its message
+        std::ostream& drop() {
+          duration_ns_ = 0;
+          return discard_;
+        }
+
+        // Sets the duration of the next result
+        void duration(int64_t ns) { duration_ns_ = ns; }
+        std::ostream& message() { return message_; }
+        void capacity(std::size_t n) { flush(); capacity_ = n; records_.reserve(std::max<std::size_t>(n, 1)); }
+        // Called at the end of each call recording results. Gives them to the
+        // reporter at once unless they are batched.
+        void completed() { if (capacity_ == 0) flush(); }
+        void timeout(std::chrono::nanoseconds d) { timeout_ = d; }
+        std::chrono::nanoseconds timeout() const { return timeout_; }
+        std::chrono::steady_clock::time_point started() const { return started_; }
+        test_id running() const { return running_; }
+
+        // Sets the deadline of the test starting now, and makes the buffer
+        // visible to the watchdog the first time
+        void arm(test_id id) {
+          if (!watched_) {
+            std::lock_guard<std::mutex> lock(tester_.watch_mutex_);
+            tester_.watched_.push_back(this);
+            watched_ = true;
+          }
+          running_ = id;
+          started_ = std::chrono::steady_clock::now();
+          deadline_.store(steady_ns_(started_) + timeout_.count(), std::memory_order_release);
+        }
+
+        // Removes the deadline at the end of the test, and notes whether it was
+        // missed. If the watchdog has taken over the buffer, the process is about
+        // to exit, so the thread waits.
+        void disarm() {
+          int64_t deadline = deadline_.load(std::memory_order_relaxed);
+          while (deadline != -1 && !deadline_.compare_exchange_weak(deadline, 0)) { }
+          if (deadline == -1) {
+            for (;;) std::this_thread::sleep_for(std::chrono::hours(1));
+          }
+          auto now = std::chrono::steady_clock::now();
+          if (steady_ns_(now) >= deadline) overdue_ = now - started_;
+        }
+
+        // Returns how long the last test lasted if it missed its deadline, else 0
+        std::chrono::nanoseconds overdue() const { return overdue_; }
+        std::chrono::nanoseconds take_overdue() { return std::exchange(overdue_, std::chrono::nanoseconds(0)); }
+
+        // Called by the watchdog, when the run is aborted on timeouts. Takes over
+        // the buffer if its deadline has passed.
+        bool expire(int64_t now_ns) {
+          int64_t deadline = deadline_.load(std::memory_order_acquire);
+          return deadline > 0 && now_ns >= deadline
+                 && deadline_.compare_exchange_strong(deadline, -1, std::memory_order_acquire);
+        }
+
+        void flush() {
+          close_();
+          if (records_.empty()) return;
+          tester_.deliver_(ResultBatch { records_, text_, tester_.interned_ });
+          records_.clear();
+          text_.clear();
+          message_.copyfmt(tester_.out_);
+        }
+
+        // Gives each buffered result to f(record, message) instead of the
+        // reporter, and removes them
+        template <typename F>
+        void take(F f) {
+          close_();
+          for (TestRecord const& r : records_) {
+            f(r, std::string_view(text_.data() + r.message, r.message_size));
+          }
+          records_.clear();
+          text_.clear();
+        }
+    };
+
+    // The check of a queued test, owning what it captured. Unlike a
+    // std::function, it accepts the move-only callables of the tests.
+    class queued_check {
+      public:
+        virtual ~queued_check() { }
+        virtual bool operator()(result_buffer& out, test_id id) = 0;
+    };
+    template <typename Check>
+    class queued_check_of final : public queued_check {
+      private:
+        Check check_;
+      public:
+        queued_check_of(Check check) : check_(std::move(check)) { }
+        bool operator()(result_buffer& out, test_id id) override { return check_(out, id); }
+    };
+
+    // A test queued in deferred mode
+    struct queued_test {
+      queued_id id;
+      std::unique_ptr<queued_check> check;
+      std::chrono::nanoseconds timeout;
+      // Index of the suite in suites_ plus one, or 0
+      uint32_t suite;
+    };
+
+    // Runs queued tests in worker processes. Defined in UnitTesterIsolation.hpp.
+    class isolated_pool;
+
+    // Formatting helpers of the reporters of UnitTesterReporters.hpp
+    class report_text;
+
+    // The default reporter, printing PASS and FAIL lines to the std::ostream of
+    // the tester. A batch is formatted in a string and written at once.
+    class stream_reporter : public Reporter {
+      private:
+        UnitTester const& tester_;
+        std::string text_;
+      public:
+        stream_reporter(UnitTester const& tester) : tester_(tester), text_() { }
+        void report(ResultBatch const& batch) override {
+          text_.clear();
+          for (TestRecord const& r : batch.records) {
+            switch (r.status) {
+              case Status::pass:
+                if (tester_.hide_pass_) continue;
+                text_.append(tester_.green_()).append("☑  PASS  ").append(tester_.reset_());
+                break;
+              case Status::fail:
+                text_.append(tester_.red_()).append("☒  FAIL  ").append(tester_.reset_());
+                break;
+              case Status::benchmark:
+                text_.append("⏱  BENCH  ");
+                break;
+              case Status::skip:
+                text_.append("☐  SKIP  ");
+                break;
+            }
+            text_.append(batch.id(r)).append(1, '\n').append(batch.message(r));
+          }
+          tester_.out_.write(text_.data(), static_cast<std::streamsize>(text_.size()));
+        }
+        void flush() override { tester_.out_.flush(); }
+    };
+
     std::ostream& out_;
-    uintmax_t count_pass_;
-    uintmax_t count_fail_;
-    uintmax_t count_skip_;
+    std::atomic<uintmax_t> count_pass_;
+    std::atomic<uintmax_t> count_fail_;
+    std::atomic<uintmax_t> count_skip_;
     bool color_output_;
     bool hide_pass_;
-    std::function<bool(std::string const&)> filter_;
+    bool deferred_;
+    std::function<bool(std::string_view)> filter_;
+    // Patterns set by only_matching(), and the cached decision for each interned
+    // id: 0 if unknown, 1 to run the test, 2 to skip it.
+    pattern_set include_;
+    pattern_set exclude_;
+    std::vector<uint8_t> decisions_;
+    // Shard of this run, and the shards assigned by shard_by_timings() to the
+    // ids of a previous run, whose durations are kept to assign them again
+    uint32_t shard_index_;
+    uint32_t shard_count_;
+    std::vector<std::pair<int64_t, std::string>> shard_timings_;
+    std::unordered_map<std::string_view, uint32_t> shard_of_;
+    // Results of the previous run, read from the cache, and of this run merged
+    // into them, by stable hash of the id. Written to the cache when destroyed.
+    struct cached_result {
+      Status status;
+      int64_t duration_ns;
+    };
+    std::string results_cache_;
+    std::unordered_map<uint64_t, cached_result> previous_results_;
+    std::unordered_map<uint64_t, cached_result> results_;
+    Rerun rerun_;
+    uintmax_t fail_fast_;
+    // Names of the suites, the current one for queued tests as an index plus
+    // one or 0, and the order of the queued tests when run
+    std::deque<std::string> suites_;
+    uint32_t suite_;
+    Order order_;
+    // Tests queued in deferred mode, waiting for run()
+    std::vector<queued_test> queue_;
+    bool timing_;
+    std::size_t report_slowest_;
+    std::vector<TestTiming> timings_;
+    std::mutex timings_mutex_;
+    // Set while run() runs tests on several threads
+    std::atomic<bool> parallel_run_;
+    bool track_allocations_;
+    std::vector<TestAllocations> allocations_;
+    std::mutex allocations_mutex_;
+    bool hardware_counters_;
+    std::vector<TestCounters> counters_;
+    std::mutex counters_mutex_;
+    // Tests whose stacks are sampled, and the number of samples of each stack,
+    // prefixed by the id of its test
+    pattern_set profiled_;
+    bool profiling_;
+    std::chrono::nanoseconds profile_interval_;
+    std::unordered_map<std::string, uint64_t> profiles_;
+    std::mutex profiles_mutex_;
+    // Total time spent in the expect_* methods and queued tests, in nanoseconds
+    std::atomic<int64_t> call_time_;
+    // The watchdog thread, started with the first time limit if the run is
+    // aborted on timeouts, checking the deadlines of the buffers of the threads
+    // which have run a limited test
+    std::mutex watch_mutex_;
+    std::condition_variable watch_cv_;
+    std::vector<result_buffer*> watched_;
+    bool stop_watch_;
+    std::thread watchdog_;
+    std::atomic<bool> abort_on_timeout_;
+    // Set when a test has missed its deadline and the run is being aborted
+    std::atomic<bool> aborting_;
+    std::atomic<unsigned> running_tests_;
+    std::size_t benchmark_samples_;
+    std::chrono::nanoseconds benchmark_sample_time_;
+    // Benchmarks measured in this run, and samples of a previous run
+    std::vector<BenchmarkResult> benchmark_results_;
+    std::vector<SweepResult> sweep_results_;
+    std::unordered_map<std::string, std::vector<double>> baseline_;
+    double baseline_alpha_;
+    double baseline_tolerance_;
+    stream_reporter stream_reporter_;
+    Reporter* reporter_;
+    std::mutex reporter_mutex_;
+    std::size_t batch_size_;
+    unsigned batch_jobs_;
+    std::size_t max_reported_cases_;
+    uint64_t property_seed_;
+    unsigned stress_threads_;
+    std::size_t stress_iterations_;
+    bool update_goldens_;
+    // Asynchronous tests started and not recorded yet, and those which timed out
+    struct async_check;
+    std::vector<std::unique_ptr<async_check>> async_tests_;
+    std::vector<std::unique_ptr<async_check>> abandoned_async_;
+    // Results of the tests run by the calling thread
+    result_buffer main_buffer_;
+    // Table of interned ids, which never move once added. Handles are indexes plus one.
+    bool intern_ids_;
+    std::deque<std::string> interned_;
+    std::unordered_map<std::string_view, uint32_t> handles_;
 
     static constexpr char c_red[] = "\x1B[31m";
     static constexpr char c_green[] = "\x1B[32m";
@@ -45,282 +1033,3858 @@ class UnitTester
     const char *green_() const { return color_output_ ? c_green : ""; }
     const char *reset_() const { return color_output_ ? c_reset : ""; }
 
-    // Counts a PASS and print pass message
-    void pass_(std::string const& id) {
+    // Counts a PASS and records it. Returns the stream for an optional message.
+    std::ostream& pass_(result_buffer& out, test_id id) {
       ++count_pass_;
-      if (!hide_pass_) {
-        out_ << green_() << "☑  PASS  " << reset_() << id << '\n';
+      if (hide_pass_ && reporter_ == &stream_reporter_ && results_cache_.empty()) return out.drop();
+      return out.add(id, Status::pass);
+    }
+
+    // Counts a FAIL and records it. Returns the stream for the failure message.
+    std::ostream& fail_(result_buffer& out, test_id id) {
+      ++count_fail_;
+      return out.add(id, Status::fail);
+    }
+
+    // Counts a SKIP of a test which ran but could not check what it expects, and
+    // records it. Returns the stream for the reason.
+    std::ostream& skipped_(result_buffer& out, test_id id) {
+      ++count_skip_;
+      return out.add(id, Status::skip);
+    }
+
+    // Gives a batch of results to the reporter
+    void deliver_(ResultBatch const& batch) {
+      std::lock_guard<std::mutex> lock(reporter_mutex_);
+      if (!results_cache_.empty()) {
+        for (TestRecord const& r : batch.records) {
+          if (r.status == Status::pass || r.status == Status::fail) {
+            results_[stable_hash_(batch.id(r))] = cached_result { r.status, r.duration_ns };
+          }
+        }
+      }
+      reporter_->report(batch);
+    }
+
+    // Returns whether a test is selected by the patterns and the condition
+    bool selected_(std::string_view id) const {
+      return (shard_count_ <= 1 || shard_of_id_(id) == shard_index_)
+             && (rerun_ != Rerun::failed_only || previous_status_(id) != Status::pass)
+             && (include_.empty() || include_.matches(id)) && (exclude_.empty() || !exclude_.matches(id))
+             && (!filter_ || filter_(id));
+    }
+
+    // Returns true and counts a skip if the test should not run.
+    // The decision is cached for interned ids.
+    bool skip_(test_id id) {
+      if (fail_fast_reached_()) {
+        ++count_skip_;
+        return true;
+      }
+      if (!filter_ && include_.empty() && exclude_.empty() && shard_count_ <= 1 && rerun_ != Rerun::failed_only) {
+        return false;
+      }
+      bool selected;
+      if (id.handle) {
+        if (id.handle >= decisions_.size()) decisions_.resize(interned_.size() + 1, 0);
+        uint8_t& decision = decisions_[id.handle];
+        if (decision == 0) decision = selected_(id.text) ? 1 : 2;
+        selected = (decision == 1);
+      } else {
+        selected = selected_(id.text);
+      }
+      if (!selected) ++count_skip_;
+      return !selected;
+    }
+
+    // Hash of an id, stable across runs, platforms and versions: FNV-1a, whose
+    // low bits are then mixed with the finalizer of splitmix64, since they only
+    // depend on the low bits of the characters
+    static uint64_t stable_hash_(std::string_view id) {
+      uint64_t h = 14695981039346656037ull;
+      for (char c : id) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ull;
+      }
+      h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+      h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+      return h ^ (h >> 31);
+    }
+
+    bool fail_fast_reached_() const { return fail_fast_ > 0 && count_fail_ >= fail_fast_; }
+
+    // Returns the status of a test in the previous run, or nothing if it did not run
+    std::optional<Status> previous_status_(std::string_view id) const {
+      auto found = previous_results_.find(stable_hash_(id));
+      if (found == previous_results_.end()) return std::nullopt;
+      return found->second.status;
+    }
+
+    // Sorts the tests in the order set by order(), then moves the tests which
+    // failed in the previous run before the others, in failed_first mode, and
+    // returns how many they are
+    std::size_t order_queue_(std::vector<queued_test>& tests) const {
+      if (order_ == Order::by_suite) {
+        std::stable_sort(tests.begin(), tests.end(),
+          [](queued_test const& a, queued_test const& b) { return a.suite < b.suite; });
+      } else if (order_ == Order::longest_first && !previous_results_.empty()) {
+        std::vector<std::pair<int64_t, std::size_t>> durations;
+        durations.reserve(tests.size());
+        for (std::size_t i = 0; i < tests.size(); ++i) {
+          auto found = previous_results_.find(stable_hash_(tests[i].id.get().text));
+          durations.emplace_back(found != previous_results_.end() ? found->second.duration_ns : 0, i);
+        }
+        std::stable_sort(durations.begin(), durations.end(),
+          [](auto const& a, auto const& b) { return a.first > b.first; });
+        std::vector<queued_test> sorted;
+        sorted.reserve(tests.size());
+        for (auto const& d : durations) sorted.push_back(std::move(tests[d.second]));
+        tests.swap(sorted);
+      }
+      if (rerun_ != Rerun::failed_first || previous_results_.empty()) return 0;
+      auto failed = std::stable_partition(tests.begin(), tests.end(),
+        [this](queued_test const& t) { return previous_status_(t.id.get().text) == Status::fail; });
+      return static_cast<std::size_t>(failed - tests.begin());
+    }
+
+    // Writes the results to the cache: one line per test with the hash of its id,
+    // its status and its duration. Tests which did not run keep their previous result.
+    void save_results_() {
+      std::unordered_map<uint64_t, cached_result> all(previous_results_);
+      for (auto const& result : results_) all[result.first] = result.second;
+      std::ofstream out(results_cache_);
+      out << std::hex;
+      for (auto const& result : all) {
+        out << result.first << ',' << (result.second.status == Status::pass ? 'p' : 'f') << ','
+            << std::dec << result.second.duration_ns << std::hex << '\n';
+      }
+    }
+
+    uint32_t shard_of_id_(std::string_view id) const {
+      if (!shard_of_.empty()) {
+        auto found = shard_of_.find(id);
+        if (found != shard_of_.end()) return found->second;
+      }
+      return static_cast<uint32_t>(stable_hash_(id) % shard_count_);
+    }
+
+    // Assigns the ids of shard_timings_ to the shards, longest first, each to the
+    // shard with the least total duration so far. The timings are sorted, so
+    // every machine computes the same assignment.
+    void assign_shards_() {
+      shard_of_.clear();
+      decisions_.clear();
+      std::vector<int64_t> load(shard_count_, 0);
+      for (auto const& timing : shard_timings_) {
+        // The first duration of an id listed twice is kept
+        if (shard_of_.count(timing.second)) continue;
+        uint32_t lightest = static_cast<uint32_t>(std::min_element(load.begin(), load.end()) - load.begin());
+        load[lightest] += timing.first;
+        shard_of_.emplace(timing.second, lightest);
+      }
+    }
+
+    // Applies UNIT_TESTER_SHARD_INDEX and UNIT_TESTER_TOTAL_SHARDS, if both are set and valid
+    void shard_from_environment_() {
+      char const* index = std::getenv("UNIT_TESTER_SHARD_INDEX");
+      char const* count = std::getenv("UNIT_TESTER_TOTAL_SHARDS");
+      if (!index || !count) return;
+      char* end_index = nullptr;
+      char* end_count = nullptr;
+      unsigned long i = std::strtoul(index, &end_index, 10);
+      unsigned long n = std::strtoul(count, &end_count, 10);
+      if (*index && !*end_index && *count && !*end_count && n > 0 && i < n && n <= std::numeric_limits<uint32_t>::max()) {
+        shard(static_cast<unsigned>(i), static_cast<unsigned>(n));
+      }
+    }
+
+    // Returns the id of a test, interning it if enabled
+    test_id intern_(std::string_view id) {
+      if (!intern_ids_) return test_id { id, 0 };
+      auto found = handles_.find(id);
+      if (found != handles_.end()) {
+        return test_id { interned_[found->second - 1], found->second };
+      }
+      interned_.emplace_back(id);
+      std::string_view text(interned_.back());
+      uint32_t handle = static_cast<uint32_t>(interned_.size());
+      handles_.emplace(text, handle);
+      return test_id { text, handle };
+    }
+
+    // Reads the CPU time of the calling thread if possible, else of the process
+    // unless other tests are running in parallel. Returns false if it cannot.
+    bool read_cpu_time_(std::chrono::nanoseconds& time) const {
+      if (thread_cpu_reader_) return thread_cpu_reader_(time);
+      std::clock_t clock = std::clock();
+      if (parallel_run_ || clock == std::clock_t(-1)) return false;
+      time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::duration<double>(clock / double(CLOCKS_PER_SEC)));
+      return true;
+    }
+
+    // RAII thing measuring the time spent in a test callable, including when it
+    // throws. Does nothing when timing is disabled.
+    class body_timer {
+      private:
+        UnitTester& tester_;
+        result_buffer& out_;
+        std::string_view id_;
+        bool enabled_;
+        bool cpu_timed_;
+        std::chrono::steady_clock::time_point wall_start_;
+        std::chrono::nanoseconds cpu_start_;
+      public:
+        body_timer(UnitTester& tester, result_buffer& out, std::string_view id)
+        : tester_(tester), out_(out), id_(id), enabled_(tester.timing_), cpu_timed_(false), wall_start_(), cpu_start_(0)
+        {
+          if (enabled_) {
+            wall_start_ = std::chrono::steady_clock::now();
+            cpu_timed_ = tester_.read_cpu_time_(cpu_start_);
+          }
+        }
+        ~body_timer() {
+          if (!enabled_) return;
+          auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wall_start_);
+          std::chrono::nanoseconds cpu_end(0);
+          std::optional<std::chrono::nanoseconds> cpu;
+          if (cpu_timed_ && tester_.read_cpu_time_(cpu_end)) cpu = cpu_end - cpu_start_;
+          out_.duration(wall.count());
+          std::lock_guard<std::mutex> lock(tester_.timings_mutex_);
+          tester_.timings_.push_back(TestTiming { std::string(id_), wall, cpu });
+        }
+    };
+
+    // RAII thing measuring the peak of the heap in use on the calling thread
+    // during its life, beyond the bytes in use at its start. Meters can be nested.
+    class heap_peak_meter {
+      private:
+        heap_usage start_;
+      public:
+        heap_peak_meter() : start_(thread_heap_) { thread_heap_.peak = thread_heap_.live; }
+        ~heap_peak_meter() { thread_heap_.peak = std::max(thread_heap_.peak, start_.peak); }
+        uint64_t peak() const { return static_cast<uint64_t>(std::max<int64_t>(thread_heap_.peak - start_.live, 0)); }
+    };
+
+    // RAII thing recording the allocations made by a test callable on the calling
+    // thread. Does nothing unless allocations are tracked.
+    class allocation_meter {
+      private:
+        UnitTester& tester_;
+        std::string_view id_;
+        bool enabled_;
+        allocation_count start_;
+        heap_peak_meter peak_;
+      public:
+        allocation_meter(UnitTester& tester, std::string_view id)
+        : tester_(tester), id_(id), enabled_(tester.track_allocations_), start_(thread_allocations_), peak_()
+        { }
+        ~allocation_meter() {
+          if (!enabled_) return;
+          allocation_count end = thread_allocations_;
+          // Read before the copy of the id allocates
+          uint64_t peak = peak_.peak();
+          TestAllocations a { std::string(id_), end.count - start_.count, end.bytes - start_.bytes, peak };
+          std::lock_guard<std::mutex> lock(tester_.allocations_mutex_);
+          tester_.allocations_.push_back(std::move(a));
+        }
+    };
+
+    // Reads the hardware counters of the calling thread, if available
+    static bool read_counters_(counter_values& values) {
+      return counter_reader_ && counter_reader_(values);
+    }
+
+    static counter_values counter_difference_(counter_values const& end, counter_values const& start) {
+      return counter_values { end.instructions - start.instructions, end.cycles - start.cycles,
+                              end.cache_misses - start.cache_misses, end.branch_misses - start.branch_misses };
+    }
+
+    // RAII thing recording the hardware events counted during a test callable on
+    // the calling thread. Does nothing unless hardware counters are enabled and
+    // available.
+    class counter_meter {
+      private:
+        UnitTester& tester_;
+        std::string_view id_;
+        bool enabled_;
+        counter_values start_;
+      public:
+        counter_meter(UnitTester& tester, std::string_view id)
+        : tester_(tester), id_(id), enabled_(false), start_()
+        {
+          enabled_ = tester.hardware_counters_ && read_counters_(start_);
+        }
+        ~counter_meter() {
+          counter_values end;
+          if (!enabled_ || !read_counters_(end)) return;
+          counter_values d = counter_difference_(end, start_);
+          TestCounters c { std::string(id_), d.instructions, d.cycles, d.cache_misses, d.branch_misses };
+          std::lock_guard<std::mutex> lock(tester_.counters_mutex_);
+          tester_.counters_.push_back(std::move(c));
+        }
+    };
+
+    // Expected duration of a test, to size what measures it: its duration in the
+    // previous run if known, else its time limit, else 1 s
+    std::chrono::nanoseconds expected_duration_(result_buffer const& out, std::string_view id) const {
+      auto found = previous_results_.find(stable_hash_(id));
+      if (found != previous_results_.end() && found->second.duration_ns > 0) {
+        return std::chrono::nanoseconds(found->second.duration_ns);
+      }
+      if (out.timeout().count() > 0) return out.timeout();
+      return std::chrono::seconds(1);
+    }
+
+    // RAII thing sampling the stacks of a test callable on the calling thread,
+    // if the test is selected by profile() and a sampler is installed
+    class profile_meter {
+      private:
+        UnitTester& tester_;
+        std::string_view id_;
+        bool enabled_;
+      public:
+        profile_meter(UnitTester& tester, result_buffer const& out, std::string_view id)
+        : tester_(tester), id_(id), enabled_(false)
+        {
+          enabled_ = tester.profiling_ && profiler_start_ && tester.profiled_.matches(id)
+                     && profiler_start_(tester.profile_interval_, tester.expected_duration_(out, id), this);
+        }
+        ~profile_meter() {
+          if (!enabled_) return;
+          std::string prefix(id_);
+          std::replace(prefix.begin(), prefix.end(), ';', ':');
+          prefix += ';';
+          std::lock_guard<std::mutex> lock(tester_.profiles_mutex_);
+          profiler_stop_([this, &prefix](std::string_view stack, uint64_t samples) {
+            tester_.profiles_[prefix + std::string(stack)] += samples;
+          });
+        }
+    };
+
+    // RAII thing around a call to the framework, the test callable included:
+    // measures the time spent in it when timing is enabled, and reports the
+    // results recorded by the call in out when it ends, unless they are batched.
+    class call_scope {
+      private:
+        UnitTester& tester_;
+        result_buffer& out_;
+        bool enabled_;
+        std::chrono::steady_clock::time_point start_;
+      public:
+        call_scope(UnitTester& tester) : call_scope(tester, tester.main_buffer_) { }
+        call_scope(UnitTester& tester, result_buffer& out)
+        : tester_(tester), out_(out), enabled_(tester.timing_), start_()
+        {
+          if (enabled_) start_ = std::chrono::steady_clock::now();
+        }
+        ~call_scope() {
+          if (enabled_) {
+            tester_.call_time_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_).count();
+          }
+          out_.completed();
+        }
+    };
+
+    // RAII thing setting the deadline of a test in its buffer, if it has a time limit
+    class deadline_guard {
+      private:
+        result_buffer& out_;
+        bool armed_;
+      public:
+        deadline_guard(result_buffer& out, test_id id) : out_(out), armed_(out.timeout().count() > 0) {
+          if (armed_) out_.arm(id);
+        }
+        ~deadline_guard() { if (armed_) out_.disarm(); }
+    };
+
+    // All the meters of a test callable, built and destroyed by the same code for
+    // every callable. The members are destroyed in reverse order, so the
+    // allocations and events of the outer meters are not counted by the inner ones.
+    // The guard, which allocates when it first registers the buffer with the
+    // watchdog, is the outermost.
+    class test_meters {
+      private:
+        deadline_guard guard_;
+        profile_meter profile_;
+        body_timer timer_;
+        allocation_meter allocations_;
+        counter_meter counters_;
+      public:
+        test_meters(UnitTester& tester, result_buffer& out, test_id id)
+        : guard_(out, id), profile_(tester, out, id.text), timer_(tester, out, id.text),
+          allocations_(tester, id.text), counters_(tester, id.text)
+        { }
+    };
+
+    // RAII thing applying the time limit given to a UnitTestNamer, if any, to
+    // the tests run or queued in its scope
+    class timeout_scope {
+      private:
+        UnitTester& tester_;
+        std::chrono::nanoseconds previous_;
+        bool active_;
+      public:
+        timeout_scope(UnitTester& tester, std::chrono::nanoseconds timeout)
+        : tester_(tester), previous_(tester.main_buffer_.timeout()), active_(timeout.count() > 0)
+        {
+          if (active_) {
+            tester_.start_watchdog_();
+            tester_.main_buffer_.timeout(timeout);
+          }
+        }
+        ~timeout_scope() { if (active_) tester_.main_buffer_.timeout(previous_); }
+    };
+
+    static int64_t steady_ns_(std::chrono::steady_clock::time_point t) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    // The watchdog is only needed to abort the run
+    void start_watchdog_() {
+      if (abort_on_timeout_ && !watchdog_.joinable()) watchdog_ = std::thread([this] { watch_(); });
+    }
+
+    // The loop of the watchdog thread
+    void watch_() {
+      std::unique_lock<std::mutex> lock(watch_mutex_);
+      while (!stop_watch_) {
+        watch_cv_.wait_for(lock, std::chrono::milliseconds(10));
+        if (!abort_on_timeout_) continue;
+        int64_t now = steady_ns_(std::chrono::steady_clock::now());
+        for (result_buffer* out : watched_) {
+          if (out->expire(now)) abort_run_(lock, out);
+        }
+      }
+    }
+
+    // Called by the watchdog, holding lock on watch_mutex_, when the test running
+    // in expired has missed its deadline. The thread running it cannot be
+    // interrupted, so no other test is started, and the watchdog waits until the
+    // other running tests have ended or missed their own deadlines. Only then,
+    // when no other thread touches the tester, does it report the tests which
+    // missed them, from a buffer of its own, output the counts of the tests,
+    // save the results cache, and exit the process.
+    [[noreturn]] void abort_run_(std::unique_lock<std::mutex>& lock, result_buffer* expired) {
+      aborting_ = true;
+      std::vector<result_buffer*> stuck { expired };
+      for (;;) {
+        // The tests run by run() are counted by running_tests_, unlike the tests
+        // run immediately, on the thread of main_buffer_
+        auto in_run = std::count_if(stuck.begin(), stuck.end(),
+          [this](result_buffer* out) { return out != &main_buffer_; });
+        if (running_tests_ <= static_cast<unsigned>(in_run)) break;
+        watch_cv_.wait_for(lock, std::chrono::milliseconds(1));
+        int64_t now = steady_ns_(std::chrono::steady_clock::now());
+        for (result_buffer* out : watched_) {
+          if (out->expire(now)) stuck.push_back(out);
+        }
+      }
+      lock.unlock();
+      auto now = std::chrono::steady_clock::now();
+      result_buffer report(*this, stuck.size());
+      for (result_buffer* out : stuck) {
+        fail_(report, out->running()) << "  timed out after "
+          << std::chrono::duration_cast<std::chrono::milliseconds>(now - out->started()).count()
+          << " ms. The test cannot be interrupted, so the run is aborted.\n";
+      }
+      report.flush();
+      {
+        std::lock_guard<std::mutex> reporter_lock(reporter_mutex_);
+        reporter_->flush();
+        count_summary_();
+        if (!results_cache_.empty()) save_results_();
+      }
+      std::cout.flush();
+      std::cerr.flush();
+      std::_Exit(EXIT_FAILURE);
+    }
+
+    // Thrown by call_test_() when a test ends after its deadline, so that it fails
+    // whatever it returned or threw
+    struct deadline_missed {
+      std::chrono::nanoseconds elapsed;
+      std::chrono::nanoseconds limit;
+    };
+
+    // Calls a test callable, measuring it if enabled, and watching its deadline
+    // if it has a time limit. Throws deadline_missed if the deadline was missed.
+    void call_test_(result_buffer& out, test_id id, callable_ref<void()> t) {
+      try {
+        if (!timing_ && !track_allocations_ && !hardware_counters_ && !profiling_) {
+          deadline_guard guard(out, id);
+          t();
+        } else {
+          test_meters meters(*this, out, id);
+          t();
+        }
+      } catch (...) {
+        if (out.overdue().count() == 0) throw;
+      }
+      std::chrono::nanoseconds elapsed = out.take_overdue();
+      if (elapsed.count() > 0) throw deadline_missed { elapsed, out.timeout() };
+    }
+
+    // Calls a test callable returning a value through call_test_(), and returns
+    // the value. Only compiled once for each type of value.
+    template <typename R>
+    R timed_(result_buffer& out, test_id id, callable_ref<R()> t) {
+      std::optional<R> r;
+      call_test_(out, id, [&t, &r] { r.emplace(t()); });
+      return std::move(*r);
+    }
+
+    // The type of the value returned by a test callable, and a reference to the
+    // callable, through which the checks are compiled once for each type of value
+    template <typename Test>
+    using result_of_ = std::decay_t<std::invoke_result_t<Test&>>;
+    template <typename Test>
+    static callable_ref<result_of_<Test>()> ref_(Test& t) { return callable_ref<result_of_<Test>()>(t); }
+
+    // Outputs the slowest tests and the split between test bodies and framework
+    void timing_summary_() {
+      std::lock_guard<std::mutex> lock(timings_mutex_);
+      std::vector<TestTiming const*> slowest;
+      std::chrono::nanoseconds body_time(0);
+      for (auto const& timing : timings_) {
+        slowest.push_back(&timing);
+        body_time += timing.wall_time;
+      }
+      std::size_t n = std::min(report_slowest_, slowest.size());
+      std::partial_sort(slowest.begin(), slowest.begin() + n, slowest.end(),
+        [](TestTiming const* a, TestTiming const* b) { return a->wall_time > b->wall_time; });
+      auto ms = [](std::chrono::nanoseconds d) { return std::chrono::duration<double, std::milli>(d).count(); };
+      local_iostream_flags f(out_);
+      out_ << std::fixed;
+      out_.precision(3);
+      if (n > 0) {
+        out_ << "Slowest tests (wall time, cpu time):\n";
+        for (std::size_t i = 0; i < n; ++i) {
+          out_ << "  " << ms(slowest[i]->wall_time) << " ms  ";
+          if (slowest[i]->cpu_time) out_ << ms(*slowest[i]->cpu_time) << " ms  ";
+          else out_ << "-  ";
+          out_ << slowest[i]->id << '\n';
+        }
+      }
+      std::chrono::nanoseconds overhead = std::chrono::nanoseconds(call_time_) - body_time;
+      out_ << ms(body_time) << " ms in test bodies, "
+           << ms(std::max(overhead, std::chrono::nanoseconds(0))) << " ms of framework overhead.\n";
+    }
+
+    // Outputs the tests which allocated the most, and the total of all tests
+    void allocation_summary_() {
+      if (!allocations_counted_) {
+        out_ << "Allocations are not counted: UnitTesterAllocations.hpp is not included in the program.\n";
+        return;
+      }
+      std::lock_guard<std::mutex> lock(allocations_mutex_);
+      std::vector<TestAllocations const*> most;
+      allocation_count total { 0, 0 };
+      TestAllocations const* highest = nullptr;
+      for (auto const& a : allocations_) {
+        if (a.count > 0) most.push_back(&a);
+        total.count += a.count;
+        total.bytes += a.bytes;
+        if (!highest || a.peak_bytes > highest->peak_bytes) highest = &a;
+      }
+      std::size_t n = std::min(report_slowest_, most.size());
+      std::partial_sort(most.begin(), most.begin() + n, most.end(),
+        [](TestAllocations const* a, TestAllocations const* b) { return a->bytes > b->bytes; });
+      if (n > 0) {
+        out_ << "Most allocating tests (bytes, allocations, peak bytes in use):\n";
+        for (std::size_t i = 0; i < n; ++i) {
+          out_ << "  " << most[i]->bytes << " B  " << most[i]->count << "  " << most[i]->peak_bytes << " B  "
+               << most[i]->id << '\n';
+        }
+      }
+      out_ << total.count << " allocations of " << total.bytes << " bytes in test bodies.\n";
+      if (highest && highest->peak_bytes > 0) {
+        out_ << "Highest peak of the heap: " << highest->peak_bytes << " bytes in " << highest->id << ".\n";
+      }
+    }
+
+    // Outputs the tests which executed the most instructions, and the totals of all tests
+    void counter_summary_() {
+      if (!counter_reader_) {
+        out_ << "Hardware counters are not read: UnitTesterCounters.hpp is not included in the program.\n";
+        return;
+      }
+      std::lock_guard<std::mutex> lock(counters_mutex_);
+      if (counters_.empty()) {
+        out_ << "Hardware counters are not available.\n";
+        return;
+      }
+      std::vector<TestCounters const*> most;
+      counter_values total { 0, 0, 0, 0 };
+      for (auto const& c : counters_) {
+        most.push_back(&c);
+        total.instructions += c.instructions;
+        total.cycles += c.cycles;
+        total.cache_misses += c.cache_misses;
+        total.branch_misses += c.branch_misses;
+      }
+      std::size_t n = std::min(report_slowest_, most.size());
+      std::partial_sort(most.begin(), most.begin() + n, most.end(),
+        [](TestCounters const* a, TestCounters const* b) { return a->instructions > b->instructions; });
+      if (n > 0) {
+        out_ << "Most instructions (instructions, cycles, cache misses, branch misses):\n";
+        for (std::size_t i = 0; i < n; ++i) {
+          out_ << "  " << most[i]->instructions << "  " << most[i]->cycles << "  " << most[i]->cache_misses
+               << "  " << most[i]->branch_misses << "  " << most[i]->id << '\n';
+        }
+      }
+      out_ << total.instructions << " instructions, " << total.cycles << " cycles, " << total.cache_misses
+           << " cache misses and " << total.branch_misses << " branch misses in test bodies.\n";
+    }
+
+    // Outputs the number of stack samples of the most sampled profiled tests
+    void profile_summary_() {
+      std::lock_guard<std::mutex> lock(profiles_mutex_);
+      std::vector<std::pair<std::string_view, uint64_t>> tests;
+      std::unordered_map<std::string_view, std::size_t> index;
+      uint64_t total = 0;
+      for (auto const& profile : profiles_) {
+        std::string_view id(profile.first);
+        id = id.substr(0, id.find(';'));
+        auto inserted = index.emplace(id, tests.size());
+        if (inserted.second) tests.emplace_back(id, 0);
+        tests[inserted.first->second].second += profile.second;
+        total += profile.second;
+      }
+      if (profiler_start_ == nullptr) {
+        out_ << "Stacks are not sampled: UnitTesterProfiler.hpp is not included in the program.\n";
+        return;
+      }
+      std::size_t n = std::min(report_slowest_, tests.size());
+      std::partial_sort(tests.begin(), tests.begin() + static_cast<std::ptrdiff_t>(n), tests.end(),
+        [](std::pair<std::string_view, uint64_t> const& a, std::pair<std::string_view, uint64_t> const& b) {
+          return a.second > b.second;
+        });
+      if (n > 0) {
+        out_ << "Most sampled tests (stack samples):\n";
+        for (std::size_t i = 0; i < n; ++i) out_ << "  " << tests[i].second << "  " << tests[i].first << '\n';
+      }
+      out_ << total << " stack samples in " << tests.size() << " profiled tests.\n";
+    }
+
+    // Queues a test in deferred mode. The result is not known yet.
+    template <typename Check>
+    bool defer_(test_id id, Check check) {
+      std::unique_ptr<queued_check> owned(new queued_check_of<Check>(std::move(check)));
+      queue_.push_back(queued_test { queued_id(id), std::move(owned), main_buffer_.timeout(), suite_ });
+      return false;
+    }
+
+    // Records the failure of a test by the exception being handled, after what
+    // was expected. Called in a catch (...) block, so the checks only have to
+    // call the callable and compare, and leave the reporting of exceptions to
+    // this function, compiled once.
+    bool failed_by_exception_(result_buffer& out, test_id id, callable_ref<void(std::ostream&)> expected) {
+      std::ostream& os = fail_(out, id);
+      expected(os);
+      try {
+        throw;
+      } catch (deadline_missed& d) {
+        os << ", timed out after " << std::chrono::duration_cast<std::chrono::milliseconds>(d.elapsed).count()
+           << " ms, over its limit of " << std::chrono::duration_cast<std::chrono::milliseconds>(d.limit).count()
+           << " ms\n";
+      } catch (std::exception& e) {
+        os << ", got exception: " << e.what() << '\n';
+      } catch (...) {
+        os << ", got exception not derived from std::exception\n";
+      }
+      return false;
+    }
+
+    // RAII thing to save and restore iostream flags in a scope
+    class local_iostream_flags {
+      private:
+        std::ios_base& io_;
+        std::ios::fmtflags f_;
+        std::streamsize precision_;
+      public:
+        local_iostream_flags(std::ios_base& io) : io_(io), f_(io_.flags()), precision_(io_.precision()) { }
+        ~local_iostream_flags() { io_.flags(f_); io_.precision(precision_); }
+    };
+
+    // Calls job(w, i) for each i in [0, n) on n_threads threads, the calling thread
+    // being one of them, w being the index of the thread in [0, n_threads). Each
+    // thread owns a deque of indices initially holding a contiguous block, takes
+    // work from its back, and steals from the front of the other deques when its
+    // own is empty. No job is added while running, so a thread can stop as soon as
+    // all deques are seen empty.
+    template <typename Job>
+    static void work_stealing_run_(std::size_t n, unsigned n_threads, Job& job) {
+      struct worker_queue {
+        std::mutex m;
+        std::deque<std::size_t> jobs;
+      };
+      if (n_threads == 0) n_threads = 1;
+      if (n_threads > n) n_threads = static_cast<unsigned>(n);
+      if (n_threads <= 1) {
+        for (std::size_t i = 0; i < n; ++i) job(0u, i);
+        return;
+      }
+      std::vector<worker_queue> queues(n_threads);
+      for (unsigned w = 0; w < n_threads; ++w) {
+        for (std::size_t i = n * w / n_threads; i < n * (w + 1) / n_threads; ++i) {
+          queues[w].jobs.push_back(i);
+        }
+      }
+      auto worker = [&queues, &job, n_threads](unsigned self) {
+        for (;;) {
+          bool found = false;
+          std::size_t i = 0;
+          {
+            std::lock_guard<std::mutex> lock(queues[self].m);
+            if (!queues[self].jobs.empty()) {
+              i = queues[self].jobs.back();
+              queues[self].jobs.pop_back();
+              found = true;
+            }
+          }
+          for (unsigned k = 1; !found && k < n_threads; ++k) {
+            worker_queue& victim = queues[(self + k) % n_threads];
+            std::lock_guard<std::mutex> lock(victim.m);
+            if (!victim.jobs.empty()) {
+              i = victim.jobs.front();
+              victim.jobs.pop_front();
+              found = true;
+            }
+          }
+          if (!found) return;
+          job(self, i);
+        }
+      };
+      std::vector<std::thread> threads;
+      for (unsigned w = 1; w < n_threads; ++w) {
+        threads.emplace_back(worker, w);
+      }
+      worker(0);
+      for (auto& t : threads) t.join();
+    }
+
+  public:
+    /** Create a UnitTester instance, with output to the specified std::ostream,
+     * by default std::cout. */
+    UnitTester(std::ostream& out = std::cout)
+    : out_(out), count_pass_(0), count_fail_(0), count_skip_(0),
+      color_output_(true), hide_pass_(false), deferred_(false), filter_(), include_(), exclude_(), decisions_(),
+      shard_index_(0), shard_count_(1), shard_timings_(), shard_of_(),
+      results_cache_(), previous_results_(), results_(), rerun_(Rerun::all), fail_fast_(0),
+      suites_(), suite_(0), order_(Order::queued), queue_(),
+      timing_(false), report_slowest_(10), timings_(), timings_mutex_(), parallel_run_(false),
+      track_allocations_(false), allocations_(), allocations_mutex_(),
+      hardware_counters_(false), counters_(), counters_mutex_(),
+      profiled_(), profiling_(false), profile_interval_(std::chrono::milliseconds(1)), profiles_(), profiles_mutex_(),
+      call_time_(0),
+      watch_mutex_(), watch_cv_(), watched_(), stop_watch_(false), watchdog_(),
+      abort_on_timeout_(true), aborting_(false), running_tests_(0),
+      benchmark_samples_(30), benchmark_sample_time_(std::chrono::milliseconds(5)),
+      benchmark_results_(), sweep_results_(), baseline_(), baseline_alpha_(0.01), baseline_tolerance_(0.05),
+      stream_reporter_(*this), reporter_(&stream_reporter_), reporter_mutex_(), batch_size_(0),
+      batch_jobs_(1), max_reported_cases_(10),
+      property_seed_(static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count())),
+      stress_threads_(4), stress_iterations_(1000), update_goldens_(false), async_tests_(), abandoned_async_(),
+      main_buffer_(*this, batch_size_), intern_ids_(false), interned_(), handles_()
+    {
+      shard_from_environment_();
+      char const* update = std::getenv("UNIT_TESTER_UPDATE_GOLDENS");
+      update_goldens_ = update && *update && std::strcmp(update, "0") != 0;
+    }
+
+    /** Create a UnitTester instance running only the tests of one shard, with
+     * output to the specified std::ostream. See shard(). */
+    UnitTester(std::ostream& out, unsigned shard_index, unsigned shard_count) : UnitTester(out) {
+      shard(shard_index, shard_count);
+    }
+
+    ~UnitTester() {
+      if (!aborting_) wait_async();
+      flush();
+      if (!results_cache_.empty()) save_results_();
+      if (watchdog_.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(watch_mutex_);
+          stop_watch_ = true;
+        }
+        watch_cv_.notify_one();
+        watchdog_.join();
+      }
+    }
+
+    /** Returns the number of tests passed so far in this UnitTester instance. */
+    uintmax_t count_pass() const { return count_pass_; }
+    /** Returns the number of tests failed so far in this UnitTester instance. */
+    uintmax_t count_fail() const { return count_fail_; }
+
+    /** Outputs a count of passed tests, and failed tests if any test failed.
+     * When timing is enabled, also outputs the slowest tests and the total time
+     * spent in test bodies and in the framework. */
+    void summary() {
+      if (!aborting_) wait_async();
+      flush();
+      if (timing_) {
+        timing_summary_();
+      }
+      if (track_allocations_) {
+        allocation_summary_();
+      }
+      if (hardware_counters_) {
+        counter_summary_();
+      }
+      if (profiling_) {
+        profile_summary_();
+      }
+      count_summary_();
+    }
+
+    // Outputs the counts of skipped, passed and failed tests
+    void count_summary_() {
+      if (count_skip_ > 0) {
+        out_ << count_skip_ << " tests skipped.\n";
+      }
+      out_ << count_pass_ << " tests passed.\n";
+      if (count_fail_ > 0) {
+        out_ << count_fail_ << " tests " << red_() << "FAILED !" << reset_() << '\n';
+      }
+    }
+
+    /** Returns whether color output is enabled. */
+    bool color_output() const { return color_output_; }
+    /** Enable or disable color output. Enabled by default. */
+    UnitTester& color_output(bool c) { main_buffer_.flush(); color_output_ = c; return *this; }
+
+    // These settings apply when results are reported, so the buffered results
+    // are flushed first to apply the previous settings to them.
+    UnitTester& hide_pass() { main_buffer_.flush(); hide_pass_ = true; return *this; }
+    UnitTester& show_pass() { main_buffer_.flush(); hide_pass_ = false; return *this; }
+
+    /** Send all the results recorded so far to the reporter, and flush it.
+     * This happens anyway when the buffer of results is full, at the end of
+     * run(), in summary(), and when this UnitTester is destroyed. */
+    void flush() {
+      main_buffer_.flush();
+      std::lock_guard<std::mutex> lock(reporter_mutex_);
+      reporter_->flush();
+    }
+
+    /** Send the results to the specified reporter instead of printing them.
+     * The reporter is not owned by this UnitTester and must outlive it.
+     * The results recorded so far are flushed to the previous reporter. */
+    UnitTester& reporter(Reporter& r) { flush(); reporter_ = &r; return *this; }
+    /** Print the results to the std::ostream of this UnitTester. This is the default. */
+    UnitTester& default_reporter() { return reporter(stream_reporter_); }
+    /** Returns how many results are buffered before being sent to the reporter. */
+    std::size_t batch_size() const { return batch_size_; }
+    /** Set how many results are buffered before being sent to the reporter, per
+     * thread. 0 by default: each result is sent as soon as its test completes,
+     * so it is printed in order with what the program itself prints, and not
+     * lost if the process dies. Batches make recording cheaper when there are
+     * many tests, but then flush() must be called before writing directly to
+     * the std::ostream of this UnitTester. */
+    UnitTester& batch_size(std::size_t records) {
+      batch_size_ = records;
+      main_buffer_.capacity(batch_size_);
+      return *this;
+    }
+
+    /** Set the number of threads used by expect_all(), including the calling
+     * thread. 1 by default. */
+    UnitTester& batch_jobs(unsigned jobs) { batch_jobs_ = jobs > 0 ? jobs : 1; return *this; }
+    /** Set how many failing cases of expect_all() are reported. 10 by default. */
+    UnitTester& max_reported_cases(std::size_t n) { max_reported_cases_ = n; return *this; }
+
+    /** Returns the seed of the inputs of expect_property(). */
+    uint64_t property_seed() const { return property_seed_; }
+    /** Set the seed of the inputs of expect_property(), to reproduce a failure.
+     * By default it is taken from the clock when the UnitTester is created, and
+     * reported by failing properties. Each property combines it with its id. */
+    UnitTester& property_seed(uint64_t seed) { property_seed_ = seed; return *this; }
+
+    /** Returns the number of threads of expect_stress() and expect_linearizable(). */
+    unsigned stress_threads() const { return stress_threads_; }
+    /** Set the number of threads of expect_stress() and expect_linearizable().
+     * The default is 4. More threads than cores still interleave, with less
+     * real parallelism. */
+    UnitTester& stress_threads(unsigned n) { stress_threads_ = n > 0 ? n : 1; return *this; }
+    /** Returns the number of iterations of expect_stress() and expect_linearizable(). */
+    std::size_t stress_iterations() const { return stress_iterations_; }
+    /** Set the number of iterations of expect_stress() and expect_linearizable().
+     * The default is 1000. */
+    UnitTester& stress_iterations(std::size_t n) { stress_iterations_ = n; return *this; }
+
+    /** Returns whether expect_matches_golden() rewrites the golden files. */
+    bool update_goldens() const { return update_goldens_; }
+    /** Make expect_matches_golden() write the output of its producer to the
+     * golden file instead of comparing them, passing unless the file cannot be
+     * written. Disabled by default, unless the environment variable
+     * UNIT_TESTER_UPDATE_GOLDENS is set to anything else than 0. */
+    UnitTester& update_goldens(bool enable) { update_goldens_ = enable; return *this; }
+
+    /** Returns whether ids are interned. */
+    bool intern_ids() const { return intern_ids_; }
+    /** Enable or disable the interning of ids. Disabled by default.
+     * Interned ids are stored once in a table kept until this UnitTester is
+     * destroyed, and results refer to them by a small integer handle. This saves
+     * copies when many tests share few ids, in particular in deferred mode. */
+    UnitTester& intern_ids(bool i) { intern_ids_ = i; return *this; }
+
+    /** Returns whether the duration of tests is measured. */
+    bool timing() const { return timing_; }
+    /** Enable or disable the measure of the duration of tests. Disabled by default.
+     * Only the call to the test callable is measured. The time spent in the
+     * framework around it is reported as overhead by summary(). When tests are
+     * run in parallel, the times of all threads are added up. The CPU time of a
+     * test is described with TestTiming. */
+    UnitTester& timing(bool t) { timing_ = t; return *this; }
+    /** Returns the time limit of each test, 0 if there is none. */
+    std::chrono::nanoseconds timeout() const { return main_buffer_.timeout(); }
+    /** Set the time limit of each test, 0 for none, which is the default.
+     * test("id").timeout(d) sets the limit of one test instead.
+     * Only the call to the test callable is limited, not benchmarks. A test over
+     * its limit is reported as failed with its duration, whatever its result.
+     * With run_isolated(), its worker process is killed at the limit, and the
+     * run goes on. Otherwise, since a thread cannot be interrupted, the run is
+     * aborted, as described with abort_on_timeout(). */
+    UnitTester& timeout(std::chrono::nanoseconds d) {
+      if (d.count() > 0) start_watchdog_();
+      main_buffer_.timeout(d);
+      return *this;
+    }
+    /** Returns whether a test missing its time limit aborts the run. */
+    bool abort_on_timeout() const { return abort_on_timeout_; }
+    /** Make a test missing its time limit abort the run, instead of failing when
+     * it returns. Enabled by default, so that a test which never returns cannot
+     * hang the run. A watchdog thread, started with the first time limit, checks
+     * the limits every 10 ms. When a test misses its limit, no other test is
+     * started, and the running tests are given until their own limits to end.
+     * Then the tests still running are reported as failed, the counts of
+     * summary() are output, the results cache is saved, and the process exits
+     * with EXIT_FAILURE. The tests not run yet are lost, and so are the results
+     * buffered by a stuck thread with batch_size(). When disabled, a test over
+     * its limit fails when it returns, and the run goes on, but a test which
+     * never returns hangs it. run_isolated() does not abort, since it kills the
+     * worker of a stuck test. */
+    UnitTester& abort_on_timeout(bool a) {
+      abort_on_timeout_ = a;
+      if (a && main_buffer_.timeout().count() > 0) start_watchdog_();
+      return *this;
+    }
+    /** Returns whether the allocations of tests are recorded. */
+    bool track_allocations() const { return track_allocations_; }
+    /** Enable or disable the recording of the heap allocations made by each test.
+     * Disabled by default. Allocations are only counted if UnitTesterAllocations.hpp
+     * is included in one source file of the program, and only on the thread
+     * running the callable of the test. summary() then reports the tests which
+     * allocated the most memory, with the peaks of their heap, and the total of
+     * all tests. */
+    UnitTester& track_allocations(bool t) { track_allocations_ = t; return *this; }
+    /** Returns the allocations recorded so far, in order of completion.
+     * Must not be called while run() is executing tests. */
+    std::vector<TestAllocations> const& allocations() const { return allocations_; }
+    /** Returns whether hardware events are counted for each test. */
+    bool hardware_counters() const { return hardware_counters_; }
+    /** Enable or disable the recording of the instructions, cycles, cache misses
+     * and branch misses of each test. Disabled by default. The events are only
+     * counted on Linux, if UnitTesterCounters.hpp is included in the program and
+     * the system allows it, and only on the thread running the callable of the
+     * test. summary() then reports the tests which executed the most
+     * instructions, and the totals of all tests. */
+    UnitTester& hardware_counters(bool c) { hardware_counters_ = c; return *this; }
+    /** Returns the hardware events recorded so far, in order of completion.
+     * Must not be called while run() is executing tests. */
+    std::vector<TestCounters> const& counters() const { return counters_; }
+
+    /** Sample the stacks of the tests whose id matches glob patterns while their
+     * callable runs, every interval of CPU time of the process. The patterns
+     * are separated by ':', and '*' and '?' match like in only_matching().
+     * An empty string stops profiling, which is the default.
+     * Stacks are only sampled on POSIX systems if UnitTesterProfiler.hpp is
+     * included in the program, only on the thread running the callable of the
+     * test, and not in the workers of run_isolated(). summary() then reports
+     * the most sampled tests, and save_profiles() writes the stacks.
+     * Example:
+     *     test.profile("parser *", std::chrono::microseconds(200));
+     */
+    UnitTester& profile(std::string_view patterns, std::chrono::nanoseconds interval = std::chrono::milliseconds(1)) {
+      profiled_ = pattern_set();
+      profiling_ = false;
+      profile_interval_ = interval.count() > 0 ? interval : std::chrono::milliseconds(1);
+      while (!patterns.empty()) {
+        std::size_t end = std::min(patterns.find(':'), patterns.size());
+        if (end > 0) {
+          profiled_.add(patterns.substr(0, end));
+          profiling_ = true;
+        }
+        patterns.remove_prefix(std::min(end + 1, patterns.size()));
+      }
+      return *this;
+    }
+    /** Returns the number of samples of each stack sampled so far. Each stack
+     * starts with the id of its test, followed by its frames from the outermost
+     * one, separated by ';'. Must not be called while run() is executing tests. */
+    std::unordered_map<std::string, uint64_t> const& profiles() const { return profiles_; }
+    /** Write the stacks sampled so far to a file, in the collapsed format read by
+     * flame graph tools: one line per stack, followed by a space and its number
+     * of samples, sorted. Ids should not contain line breaks.
+     * @return false if the file could not be written. */
+    bool save_profiles(std::string const& path) const {
+      std::vector<std::unordered_map<std::string, uint64_t>::value_type const*> stacks;
+      stacks.reserve(profiles_.size());
+      for (auto const& profile : profiles_) stacks.push_back(&profile);
+      std::sort(stacks.begin(), stacks.end(), [](auto const* a, auto const* b) { return a->first < b->first; });
+      std::ofstream out(path);
+      for (auto const* stack : stacks) out << stack->first << ' ' << stack->second << '\n';
+      return !!out;
+    }
+    /** Set how many of the slowest tests summary() reports, and of the tests
+     * allocating the most memory or executing the most instructions. 10 by default. */
+    UnitTester& report_slowest(std::size_t n) { report_slowest_ = n; return *this; }
+    /** Set the number of samples measured by benchmarks. 30 by default. */
+    UnitTester& benchmark_samples(std::size_t n) { benchmark_samples_ = n > 0 ? n : 1; return *this; }
+    /** Set the minimum duration of one sample of a benchmark, 5 ms by default.
+     * The number of iterations of each sample is calibrated to reach it. */
+    UnitTester& benchmark_sample_time(std::chrono::nanoseconds d) { benchmark_sample_time_ = d; return *this; }
+
+    /** Returns the benchmarks measured so far by this UnitTester. */
+    std::vector<BenchmarkResult> const& benchmark_results() const { return benchmark_results_; }
+
+    /** Returns the sweeps measured so far by this UnitTester. */
+    std::vector<SweepResult> const& sweep_results() const { return sweep_results_; }
+
+    /** Write the points of the sweeps measured so far to a CSV file, with a
+     * header line and the columns size, threads, time_ns, items_per_second,
+     * efficiency and id, for plotting tools. Ids should not contain line breaks.
+     * @return false if the file could not be written. */
+    bool save_sweeps(std::string const& path) const {
+      std::ofstream out(path);
+      out.precision(17);
+      out << "size,threads,time_ns,items_per_second,efficiency,id\n";
+      for (auto const& result : sweep_results_) {
+        for (SweepPoint const& point : result.points) {
+          out << point.size << ',' << point.threads << ',' << point.time_ns << ',' << point.throughput << ','
+              << point.efficiency << ',' << result.id << '\n';
+        }
+      }
+      return !!out;
+    }
+
+    /** Load the samples of benchmarks from a file written by save_baseline().
+     * They replace any samples previously loaded for the same ids.
+     * @return false if the file could not be read. */
+    bool load_baseline(std::string const& path) {
+      std::ifstream in(path);
+      if (!in) return false;
+      std::string line;
+      while (std::getline(in, line)) {
+        // Each line is: count,sample_1,...,sample_count,id
+        std::istringstream fields(line);
+        std::size_t n = 0;
+        char comma = 0;
+        if (!(fields >> n >> comma) || comma != ',') continue;
+        std::vector<double> samples(n);
+        bool valid = true;
+        for (double& sample : samples) {
+          valid = valid && (fields >> sample >> comma) && comma == ',';
+        }
+        std::string id;
+        std::getline(fields, id);
+        if (valid) {
+          std::sort(samples.begin(), samples.end());
+          baseline_[id] = std::move(samples);
+        }
+      }
+      return true;
+    }
+
+    /** Write the samples of the benchmarks measured so far to a file, in a simple
+     * CSV format readable by load_baseline(). Ids should not contain line breaks.
+     * @return false if the file could not be written. */
+    bool save_baseline(std::string const& path) const {
+      std::ofstream out(path);
+      out.precision(17);
+      for (auto const& result : benchmark_results_) {
+        out << result.samples_ns.size() << ',';
+        for (double sample : result.samples_ns) out << sample << ',';
+        out << result.id << '\n';
+      }
+      return !!out;
+    }
+
+    /** Set the significance level at which expect_no_regression() reports a
+     * slowdown. 0.01 by default. */
+    UnitTester& baseline_alpha(double alpha) { baseline_alpha_ = alpha; return *this; }
+    /** Set the relative slowdown tolerated by expect_no_regression(), 0.05 by
+     * default. Smaller differences are not reported even if significant. */
+    UnitTester& baseline_tolerance(double tolerance) { baseline_tolerance_ = tolerance; return *this; }
+
+    /** Prevent the compiler from optimizing away the computation of a value.
+     * The address of the value is given to a function called through a volatile
+     * pointer, which the compiler must assume reads it. */
+    template <typename T>
+    static void do_not_optimize(T const& value) {
+      static void (* volatile sink)(void const*) = [](void const*) { };
+      sink(&value);
+    }
+
+    /** Returns the durations measured so far, in order of completion.
+     * Must not be called while run() is executing tests. */
+    std::vector<TestTiming> const& timings() const { return timings_; }
+
+    /** Queue the tests given to the expect_* methods instead of running them.
+     * The queued tests are executed by run(). In this mode the expect_* methods
+     * return false since the result is not known yet.
+     * The callables are moved into the queue, so they can be move-only, and the
+     * expected values are copied. They must not refer to anything that is
+     * destroyed before run() is called. */
+    UnitTester& deferred() { deferred_ = true; return *this; }
+    /** Run the tests immediately in the expect_* methods. This is the default. */
+    UnitTester& immediate() { deferred_ = false; return *this; }
+
+    /** Create a fixture: a value built by a factory on first use, and shared by
+     * all the tests which capture a copy of the returned handle. The value is
+     * only given as const, and can be used by tests running in parallel.
+     * run() releases the callable of each test once it has run, so the value is
+     * destroyed after the last test using it, unless other copies of the handle
+     * remain, such as the one returned here. With run_isolated(), each worker
+     * process builds its own value.
+     * Example:
+     *     UnitTester test;
+     *     test.deferred();
+     *     {
+     *       auto index = test.fixture([] { return Index::load("words.txt"); });
+     *       test.expect_true("find word", [index] { return index->find("word"); });
+     *       test.expect_false("find nothing", [index] { return index->find("xyzzy"); });
+     *     }
+     *     test.run();
+     */
+    template <typename Make>
+    static auto fixture(Make make) { return Fixture<std::decay_t<decltype(make())>>(std::move(make)); }
+
+    /** Put the tests queued from now on in a suite with the specified name, or in
+     * no suite if the name is empty. Suites are shown by list(), and used by
+     * order(Order::by_suite). They change neither the ids nor the output of the
+     * tests. */
+    UnitTester& suite(std::string_view name) {
+      if (name.empty()) {
+        suite_ = 0;
+        return *this;
+      }
+      auto found = std::find(suites_.begin(), suites_.end(), name);
+      if (found == suites_.end()) found = suites_.emplace(suites_.end(), name);
+      suite_ = static_cast<uint32_t>(found - suites_.begin()) + 1;
+      return *this;
+    }
+
+    /** Returns the number of tests queued in deferred mode, waiting for run(). */
+    std::size_t queued() const { return queue_.size(); }
+
+    /** Output the ids of the queued tests without running them, one per line,
+     * preceded by their suite and ": " if they are in one. Skipped tests are not
+     * queued, so this lists the tests selected by only_matching(), shard() or
+     * rerun(). The tests stay queued.
+     * Example:
+     *     if (argc > 1 && std::string_view(argv[1]) == "--list") {
+     *       test.list();
+     *       return 0;
+     *     }
+     */
+    void list(std::ostream& os) const {
+      for (auto const& test : queue_) {
+        if (test.suite) os << suites_[test.suite - 1] << ": ";
+        os << test.id.get().text << '\n';
+      }
+    }
+    /** Output the ids of the queued tests to the std::ostream of this UnitTester. */
+    void list() {
+      flush();
+      list(out_);
+      out_.flush();
+    }
+
+    /** Set the order in which run() and run_isolated() start the queued tests:
+     * - Order::queued keeps the order in which they were queued. This is the default.
+     * - Order::longest_first starts the tests which took the longest in the
+     *   previous run first, according to the results cache, so that the threads
+     *   or processes finish at about the same time. Timing must have been
+     *   enabled in the previous run.
+     * - Order::by_suite groups the tests of each suite, in the order the suites
+     *   were created after the tests in no suite, keeping the tests of a suite in
+     *   the order they were queued.
+     * With rerun(Rerun::failed_first), the tests which failed in the previous run
+     * are still started first, in this order. */
+    UnitTester& order(Order o) { order_ = o; return *this; }
+
+    /** Execute the tests queued in deferred mode on the specified number of threads,
+     * by default one per hardware thread. Each thread takes tests from its own
+     * share and steals from the others when it runs out of work.
+     * Each thread buffers its results and reports them in batches, so tests are
+     * reported in completion order but the output of a test is never split.
+     * @param jobs The number of threads to use, including the calling thread.
+     * @return true if all the executed tests succeeded. */
+    bool run(unsigned jobs = std::thread::hardware_concurrency()) {
+      std::vector<queued_test> tests;
+      tests.swap(queue_);
+      main_buffer_.flush();
+      std::size_t n_failed_before = order_queue_(tests);
+      std::atomic<bool> all_passed(true);
+      // One buffer per thread, created by the thread on its first test
+      std::vector<std::unique_ptr<result_buffer>> buffers(jobs > 0 ? jobs : 1);
+      std::size_t first = 0;
+      auto job = [this, &tests, &all_passed, &buffers, &first](unsigned worker, std::size_t k) {
+        std::size_t i = first + k;
+        // Once the run is aborted by a timeout, no other test is started, and
+        // the results are flushed for the summary. The test is counted first,
+        // so the watchdog either sees it running or stops it here.
+        ++running_tests_;
+        if (aborting_) {
+          --running_tests_;
+          return;
+        }
+        if (fail_fast_reached_()) {
+          --running_tests_;
+          ++count_skip_;
+          return;
+        }
+        if (!buffers[worker]) buffers[worker].reset(new result_buffer(*this, batch_size_));
+        result_buffer& out = *buffers[worker];
+        call_scope scope(*this, out);
+        out.timeout(tests[i].timeout);
+        if (!(*tests[i].check)(out, tests[i].id.get())) all_passed = false;
+        // Destroys what the test holds, such as its copies of fixtures
+        tests[i].check.reset();
+        if (aborting_) out.flush();
+        --running_tests_;
+      };
+      // The CPU time of the process is shared by the tests run in parallel
+      parallel_run_ = jobs > 1 && tests.size() > 1;
+      // The tests which failed previously are all run before the others
+      work_stealing_run_(n_failed_before, jobs, job);
+      first = n_failed_before;
+      work_stealing_run_(tests.size() - n_failed_before, jobs, job);
+      parallel_run_ = false;
+      for (auto& buffer : buffers) {
+        if (buffer) buffer->flush();
+      }
+      if (!wait_async()) all_passed = false;
+      flush();
+      return all_passed;
+    }
+
+    /** Wait for the asynchronous tests started so far, and record their results
+     * as they complete. A test still incomplete after the time limit set by
+     * timeout() when it started is reported as failed, and its future is kept
+     * until this UnitTester is destroyed. This is called by run(), summary() and
+     * the destructor.
+     * @return true if all these tests succeeded. */
+    bool wait_async() {
+      bool all_passed = true;
+      while (!async_tests_.empty()) {
+        auto now = std::chrono::steady_clock::now();
+        bool progress = false;
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < async_tests_.size(); ++i) {
+          std::unique_ptr<async_check>& test = async_tests_[i];
+          if (test->ready()) {
+            if (!test->finish(main_buffer_)) all_passed = false;
+            progress = true;
+          } else if (now >= test->deadline) {
+            fail_(main_buffer_, test->id.get()) << "  timed out after "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(now - test->started).count() << " ms.\n";
+            abandoned_async_.push_back(std::move(test));
+            all_passed = false;
+            progress = true;
+          } else if (kept++ != i) {
+            async_tests_[kept - 1] = std::move(test);
+          }
+        }
+        async_tests_.resize(kept);
+        main_buffer_.completed();
+        if (!progress && !async_tests_.empty()) async_tests_.front()->wait(std::chrono::milliseconds(1));
+      }
+      return all_passed;
+    }
+
+    /** Execute the tests queued in deferred mode in a pool of worker processes,
+     * by default one per hardware thread. A test crashing its worker, for example
+     * with a segmentation fault or an abort, is reported as failed with the
+     * signal, and the worker is replaced. Workers are reused across tests to
+     * avoid the cost of a fork per test.
+     * Results are reported like with run(), but the changes made by tests to the
+     * memory of the process are lost, since they happen in the workers.
+     * This method is only available on POSIX systems, and is defined in
+     * UnitTesterIsolation.hpp, which must be included to use it.
+     * @param jobs The number of worker processes.
+     * @return true if all the executed tests succeeded. */
+    bool run_isolated(unsigned jobs = std::thread::hardware_concurrency());
+
+    /** Run tests only if a specified condition is true.
+     * The id string of a test is passed to the function, preferably as a
+     * std::string_view. A function taking a std::string is also accepted, at
+     * the cost of a copy of the id for each test.
+     * A call to only_if replaces the previous condition.
+     * The condition is always true by default. */
+    template <typename Filter>
+    UnitTester& only_if(Filter f) {
+      include_ = pattern_set();
+      exclude_ = pattern_set();
+      decisions_.clear();
+      if constexpr (std::is_invocable_r_v<bool, Filter&, std::string_view>) {
+        filter_ = f;
+      } else {
+        filter_ = [f](std::string_view id) { return f(std::string(id)); };
+      }
+      return *this;
+    }
+
+    /** Run only the tests whose id matches glob patterns.
+     * The patterns are separated by ':'. In a pattern, '*' matches any sequence of
+     * characters and '?' matches any character. A pattern starting with '-'
+     * excludes the matching tests instead. If there are only excluding patterns,
+     * all the other tests run.
+     * The patterns are compiled once, which is much faster than a condition given
+     * to only_if(), and the decision is cached for each id if ids are interned.
+     * A call to only_matching replaces the previous condition or patterns.
+     * Example:
+     *     test.only_matching("parser *:lexer *:-*slow*");
+     */
+    UnitTester& only_matching(std::string_view patterns) {
+      always();
+      while (!patterns.empty()) {
+        std::size_t end = std::min(patterns.find(':'), patterns.size());
+        std::string_view pattern = patterns.substr(0, end);
+        if (!pattern.empty() && pattern[0] == '-') {
+          exclude_.add(pattern.substr(1));
+        } else if (!pattern.empty()) {
+          include_.add(pattern);
+        }
+        patterns.remove_prefix(std::min(end + 1, patterns.size()));
+      }
+      return *this;
+    }
+
+    /** Run only the tests of one shard out of shard_count, to split the tests of a
+     * program across several machines, each running a different shard index.
+     * Each test is assigned to a shard by a hash of its id, stable across runs
+     * and platforms, or by shard_by_timings(). The tests of the other shards are
+     * counted as skipped. shard(0, 1), the default, runs all the tests.
+     * The shard can also be given to the constructor, or by the environment
+     * variables UNIT_TESTER_SHARD_INDEX and UNIT_TESTER_TOTAL_SHARDS, read when
+     * the UnitTester is created. Sharding is independent of only_if() and
+     * only_matching(), and applies in addition to them.
+     * An index out of range is replaced by index % shard_count. */
+    UnitTester& shard(unsigned shard_index, unsigned shard_count) {
+      shard_count_ = shard_count > 0 ? shard_count : 1;
+      shard_index_ = shard_index % shard_count_;
+      assign_shards_();
+      return *this;
+    }
+    /** Returns the index of the shard run by this UnitTester. */
+    unsigned shard_index() const { return shard_index_; }
+    /** Returns the number of shards. 1 if tests are not sharded. */
+    unsigned shard_count() const { return shard_count_; }
+
+    /** Assign the tests to shards according to their durations in a previous run,
+     * read from a file written by save_timings(), so that all the shards take
+     * about the same time. The longest tests are assigned first, each to the
+     * shard with the least total duration so far. Tests missing from the file
+     * are assigned by the hash of their id.
+     * All the machines must read the same file to agree on the assignment.
+     * @return false if the file could not be read. */
+    bool shard_by_timings(std::string const& path) {
+      std::ifstream in(path);
+      if (!in) return false;
+      shard_timings_.clear();
+      std::string line;
+      while (std::getline(in, line)) {
+        // Each line is: duration_ns,id
+        std::istringstream fields(line);
+        int64_t ns = 0;
+        char comma = 0;
+        std::string id;
+        if (!(fields >> ns >> comma) || comma != ',') continue;
+        std::getline(fields, id);
+        shard_timings_.emplace_back(ns, std::move(id));
+      }
+      std::sort(shard_timings_.begin(), shard_timings_.end(),
+        [](auto const& a, auto const& b) { return a.first != b.first ? a.first > b.first : a.second < b.second; });
+      assign_shards_();
+      return true;
+    }
+
+    /** Write the total wall time of each test id measured so far to a file, in a
+     * simple CSV format readable by shard_by_timings(). Timing must be enabled.
+     * Ids should not contain line breaks.
+     * @return false if the file could not be written. */
+    bool save_timings(std::string const& path) const {
+      std::vector<std::pair<std::string_view, int64_t>> totals;
+      std::unordered_map<std::string_view, std::size_t> index;
+      for (auto const& timing : timings_) {
+        auto inserted = index.emplace(timing.id, totals.size());
+        if (inserted.second) totals.emplace_back(timing.id, 0);
+        totals[inserted.first->second].second += timing.wall_time.count();
+      }
+      std::ofstream out(path);
+      for (auto const& total : totals) {
+        out << total.second << ',' << total.first << '\n';
+      }
+      return !!out;
+    }
+
+    /** Keep the results of the tests in a file, to select tests with rerun() in
+     * the next run. The results of the previous run are read from the file now,
+     * if it exists, and the file is written when this UnitTester is destroyed.
+     * Only the hash of each id is stored, with its status and duration, and the
+     * tests which did not run keep their previous result.
+     * @return true if results of a previous run were read. */
+    bool results_cache(std::string const& path) {
+      results_cache_ = path;
+      previous_results_.clear();
+      decisions_.clear();
+      std::ifstream in(path);
+      if (!in) return false;
+      std::string line;
+      while (std::getline(in, line)) {
+        // Each line is: hash in hexadecimal,p or f,duration_ns
+        std::istringstream fields(line);
+        uint64_t hash = 0;
+        char comma1 = 0, status = 0, comma2 = 0;
+        int64_t ns = 0;
+        if (fields >> std::hex >> hash >> comma1 >> status >> comma2 >> std::dec >> ns
+            && comma1 == ',' && comma2 == ',' && (status == 'p' || status == 'f')) {
+          previous_results_[hash] = cached_result { status == 'p' ? Status::pass : Status::fail, ns };
+        }
+      }
+      return !previous_results_.empty();
+    }
+
+    /** Select the tests to run according to the results cache:
+     * - Rerun::all runs all the tests. This is the default.
+     * - Rerun::failed_first runs the tests which failed in the previous run
+     *   before the others. The order of tests can only change in run() and
+     *   run_isolated(), so it has no effect on tests run immediately.
+     * - Rerun::failed_only runs only the tests which did not pass in the previous
+     *   run, including new tests. The others are counted as skipped.
+     * With interned ids, the decision is cached for each id. */
+    UnitTester& rerun(Rerun r) { rerun_ = r; decisions_.clear(); return *this; }
+
+    /** Skip all the tests after max_failures tests have failed, 0 to never stop,
+     * which is the default. The skipped tests are counted as such. Tests already
+     * running on other threads or processes complete. */
+    UnitTester& fail_fast(uintmax_t max_failures) { fail_fast_ = max_failures; return *this; }
+
+    /** Remove any condition set by only_if() or only_matching(). */
+    UnitTester& always() {
+      decltype(filter_) empty_func;
+      filter_.swap(empty_func);
+      include_ = pattern_set();
+      exclude_ = pattern_set();
+      decisions_.clear();
+      return *this;
+    }
+
+    /** Execute a test that is expected to return the boolean value true.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester
+     * @param id A string identifying this test case in the output.
+     * @param t A callable that is expected to return true if the test is successful.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test("1+1 equals 2").expect_true([] {
+     *       return 1+1 == 2;
+     *     });
+     */
+    template <typename Test>
+    bool expect_true(std::string_view id, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if constexpr (is_async_<Test>::value) {
+        return start_async_(tid, t, [this](result_buffer& out, test_id checked_id, auto& get) {
+          return check_bool_(out, checked_id, true, get);
+        });
+      } else {
+        if (deferred_) {
+          return defer_(tid, [this, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+            return check_bool_(out, checked_id, true, t);
+          });
+        }
+        return check_bool_(main_buffer_, tid, true, t);
+      }
+    }
+
+    /** Execute a test that is expected to return the boolean value false.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester
+     * @param id A string identifying this test case in the output.
+     * @param t A callable that is expected to return false if the test is successful.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_false("1+1 does not equals 3", [] {
+     *       return 1+1 == 3;
+     *     });
+     */
+    template <typename Test>
+    bool expect_false(std::string_view id, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if constexpr (is_async_<Test>::value) {
+        return start_async_(tid, t, [this](result_buffer& out, test_id checked_id, auto& get) {
+          return check_bool_(out, checked_id, false, get);
+        });
+      } else {
+        if (deferred_) {
+          return defer_(tid, [this, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+            return check_bool_(out, checked_id, false, t);
+          });
+        }
+        return check_bool_(main_buffer_, tid, false, t);
+      }
+    }
+
+    /** Execute a test that is expected to return a specified value.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester
+     * @param id A string identifying this test case in the output.
+     * @param value The value expected to be returned.
+     * @param t A callable that is expected to return something equal to 'value' if
+     *          the test is successful.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test("1+1 equals 2").expect_value(2, [] { return 1+1; });
+     *
+     * When t returns a std::future, or another type for which AsyncResult is
+     * specialized, the test is asynchronous: the future is checked when it is
+     * ready, in wait_async(), and this returns true once the test is started.
+     * Asynchronous tests start immediately, even in deferred mode.
+     *
+     *     test("async").expect_value(2, [] { return std::async([] { return 1+1; }); });
+     */
+    template <typename Test, typename T>
+    bool expect_value(std::string_view id, T const& value, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if constexpr (is_async_<Test>::value) {
+        return start_async_(tid, t, [this, value](result_buffer& out, test_id checked_id, auto& get) {
+          return check_value_(out, checked_id, value, ref_(get));
+        });
+      } else {
+        if (deferred_) {
+          return defer_(tid, [this, value, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+            return check_value_(out, checked_id, value, ref_(t));
+          });
+        }
+        return check_value_(main_buffer_, tid, value, ref_(t));
+      }
+    }
+
+    /** Execute a test evaluated at compile time when possible, expected to return
+     * a specified value.
+     * Test names a function, or a constexpr callable object of static storage
+     * duration such as a lambda. When calling it is a constant expression, it is
+     * called by the compiler, and this only compares the result and records it,
+     * even in deferred mode. Otherwise, for instance when it throws or is not
+     * constexpr, this is expect_value(id, value, Test).
+     * To fail the compilation instead, use static_assert.
+     * @param id A string identifying this test case in the output.
+     * @param value The value expected to be returned.
+     * @return true if the test succeeded.
+     * Example:
+     *     constexpr int square(int x) { return x * x; }
+     *     static constexpr auto square_of_4 = [] { return square(4); };
+     *
+     *     UnitTester test;
+     *     test.expect_constexpr<square_of_4>("square of 4", 16);
+     */
+    template <auto& Test, typename T>
+    bool expect_constexpr(std::string_view id, T const& value) {
+      if constexpr (is_constant_call_<Test>::value) {
+        call_scope scope(*this);
+        test_id tid = intern_(id);
+        if (skip_(tid)) return false;
+        static constexpr auto result = Test();
+        if (result == value) {
+          pass_(main_buffer_, tid);
+          return true;
+        }
+        fail_(main_buffer_, tid) << "  expected value " << formatted_(value) << ", computed " << formatted_(result)
+                                 << " at compile time instead.\n";
+        return false;
+      } else {
+        return expect_value(id, value, Test);
+      }
+    }
+
+    /** Execute a test evaluated at compile time when possible, expected to return
+     * true. See expect_constexpr(id, value).
+     * Example:
+     *     static constexpr auto negative_square = [] { return square(-3) == 9; };
+     *
+     *     UnitTester test;
+     *     test.expect_constexpr<negative_square>("square of a negative number");
+     */
+    template <auto& Test>
+    bool expect_constexpr(std::string_view id) {
+      if constexpr (is_constant_call_<Test>::value) {
+        call_scope scope(*this);
+        test_id tid = intern_(id);
+        if (skip_(tid)) return false;
+        if constexpr (static_cast<bool>(Test())) {
+          pass_(main_buffer_, tid);
+          return true;
+        } else {
+          fail_(main_buffer_, tid) << "  expected true, computed false at compile time.\n";
+          return false;
+        }
+      } else {
+        return expect_true(id, Test);
+      }
+    }
+
+    /** Execute a test that is expected to return a value within a specified range.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester.
+     * The type of the value should implement usual comparison operators.
+     * Use with caution, since a test with a random result passing this once is not
+     * a guarantee that the test will always pass.
+     * Can be useful for testing floating point results.
+     * @param id A string identifying this test case in the output.
+     * @param min The minimum value expected to be returned (included).
+     * @param max The maximum value expected to be returned (included).
+     * @param t A callable that is expected to return a value within a range if the test is successful.
+     * @return true of the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_in_range("rng test", 0, RAND_MAX, [] { return rand(); });
+     *     test("one third").expect_in_range(0.333, 0.334, []{ return 1.0 / 3.0; });
+     */
+    template <typename Test, typename T>
+    bool expect_in_range(std::string_view id, T const& min, T const& max, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if constexpr (is_async_<Test>::value) {
+        return start_async_(tid, t, [this, min, max](result_buffer& out, test_id checked_id, auto& get) {
+          return check_in_range_(out, checked_id, min, max, ref_(get));
+        });
+      } else {
+        if (deferred_) {
+          return defer_(tid, [this, min, max, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+            return check_in_range_(out, checked_id, min, max, ref_(t));
+          });
+        }
+        return check_in_range_(main_buffer_, tid, min, max, ref_(t));
+      }
+    }
+
+    /** Execute a test that is expected to throw an exception of any type.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester
+     * @param id A string identifying this test case in the output.
+     * @param t A callable that is expected to throw an exception if the test is successful.
+     * @return true of the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_any_exception("exception example", [] {
+     *       throw "something";
+     *     });
+     */
+    template <typename Test>
+    bool expect_any_exception(std::string_view id, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if (deferred_) {
+        return defer_(tid, [this, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+          return check_any_exception_(out, checked_id, t);
+        });
+      }
+      return check_any_exception_(main_buffer_, tid, t);
+    }
+
+    /** Execute a test that is expected to throw an exception of a specified type.
+     * The expected exception type is given as a template parameter of this method.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester
+     * @param id A string identifying this test case in the output.
+     * @param t A callable that is expected to throw an exception if the test is successful.
+     * @return true of the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_exception<std::logic_error>("exception example", [] {
+     *       throw std::logic_error("this example is not realistic");
+     *     });
+     */
+    template <typename Except, typename Test>
+    bool expect_exception(std::string_view id, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if (deferred_) {
+        return defer_(tid, [this, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+          return check_exception_<Except>(out, checked_id, t);
+        });
+      }
+      return check_exception_<Except>(main_buffer_, tid, t);
+    }
+
+    /** Execute a test that is expected to make no heap allocation.
+     * Only the allocations made by the callable on the calling thread are
+     * counted. The test fails if UnitTesterAllocations.hpp is not included in
+     * one source file of the program, since allocations are not counted then.
+     * @param id A string identifying this test in the output.
+     * @param t The callable to check. Its result is ignored.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     std::vector<int> v;
+     *     v.reserve(100);
+     *     test.expect_no_alloc("push_back into reserved vector", [&] { v.push_back(1); });
+     */
+    template <typename Test>
+    bool expect_no_alloc(std::string_view id, Test t) { return expect_max_alloc(id, 0, std::move(t)); }
+
+    /** Execute a test that is expected to make at most max_count heap allocations.
+     * Allocations are counted like with expect_no_alloc().
+     * @param id A string identifying this test in the output.
+     * @param max_count The maximum number of allocations.
+     * @param t The callable to check. Its result is ignored.
+     * @return true if the test succeeded. */
+    template <typename Test>
+    bool expect_max_alloc(std::string_view id, uint64_t max_count, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if (deferred_) {
+        return defer_(tid, [this, max_count, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+          return check_alloc_(out, checked_id, max_count, t);
+        });
+      }
+      return check_alloc_(main_buffer_, tid, max_count, t);
+    }
+
+    /** Execute a test that is expected to keep the heap below a size: the most
+     * bytes in use at once during the callable, beyond those in use when it
+     * started, must be at most max_bytes. Bytes are counted on the thread
+     * running the callable, like allocations with expect_no_alloc(), and the
+     * test fails if UnitTesterAllocations.hpp is not included in the program.
+     * On failure, the growth of the resident set size of the process during
+     * the callable is also reported, when UnitTesterCounters.hpp can read it.
+     * @param id A string identifying this test in the output.
+     * @param max_bytes The maximum growth of the heap.
+     * @param t The callable to check. Its result is ignored.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_peak_memory_below("parse 1 MB", 4 << 20, [&] { return parse(document); });
+     */
+    template <typename Test>
+    bool expect_peak_memory_below(std::string_view id, uint64_t max_bytes, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if (deferred_) {
+        return defer_(tid, [this, max_bytes, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+          return check_peak_memory_(out, checked_id, max_bytes, t);
+        });
+      }
+      return check_peak_memory_(main_buffer_, tid, max_bytes, t);
+    }
+
+    /** Execute a test that is expected to execute at most max_count instructions.
+     * The instructions are counted in user space, on the calling thread only.
+     * Instruction counts are much more stable than durations, even on a loaded
+     * machine, which makes them suitable to catch regressions.
+     * Where hardware counters are not available, because UnitTesterCounters.hpp
+     * is not included, the system is not Linux or forbids it, the callable is
+     * still run, and the test is reported and counted as skipped if it does not
+     * throw, so that a machine without counters does not pass it silently.
+     * @param id A string identifying this test in the output.
+     * @param max_count The maximum number of instructions.
+     * @param t The callable to check. Its result is ignored.
+     * @return true if the test succeeded, false if it failed or was skipped.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_max_instructions("hash of a short key", 200, [] {
+     *       UnitTester::do_not_optimize(std::hash<std::string_view>()("key"));
+     *     });
+     */
+    template <typename Test>
+    bool expect_max_instructions(std::string_view id, uint64_t max_count, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if (deferred_) {
+        return defer_(tid, [this, max_count, t = std::move(t)](result_buffer& out, test_id checked_id) mutable {
+          return check_instructions_(out, checked_id, max_count, t);
+        });
+      }
+      return check_instructions_(main_buffer_, tid, max_count, t);
+    }
+
+    /** Execute a table-driven test over a range of inputs, as a single test.
+     * For each input x, test(x) is expected to return something equal to
+     * expected(x). Only the failing cases are recorded, up to
+     * max_reported_cases(), with their index in the range.
+     * With batch_jobs() greater than 1 and a random access range, the range is
+     * split in chunks checked in parallel, so test and expected must then be
+     * safe to call concurrently.
+     * This runs immediately even in deferred mode, since it can use several
+     * threads itself.
+     * A single PASS or FAIL indication will be output to the std::ostream
+     * associated with this UnitTester.
+     * @param id A string identifying this test in the output.
+     * @param inputs The range of inputs.
+     * @param expected A callable returning the expected value for an input.
+     * @param t A callable returning the value to check for an input.
+     * @return true if the test succeeded for all inputs.
+     * Example:
+     *     UnitTester test;
+     *
+     *     std::vector<int> inputs(1000000);
+     *     std::iota(inputs.begin(), inputs.end(), 0);
+     *     test.expect_all("square", inputs, [](int x) { return x * x; }, [](int x) { return square(x); });
+     */
+    template <typename Range, typename Expected, typename Test>
+    bool expect_all(std::string_view id, Range const& inputs, Expected expected, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      using iterator = decltype(std::begin(inputs));
+      constexpr bool random_access =
+        std::is_base_of_v<std::random_access_iterator_tag, typename std::iterator_traits<iterator>::iterator_category>;
+      iterator first = std::begin(inputs);
+      std::size_t n = static_cast<std::size_t>(std::distance(first, std::end(inputs)));
+      unsigned jobs = random_access ? batch_jobs_ : 1;
+      std::size_t n_chunks = (jobs > 1) ? std::min<std::size_t>(n, jobs * std::size_t(8)) : (n > 0);
+      std::vector<std::vector<case_failure>> failures(n_chunks);
+      std::vector<std::size_t> failed(n_chunks, 0);
+      auto check_chunk = [&](unsigned, std::size_t chunk) {
+        std::size_t begin = n * chunk / n_chunks;
+        std::size_t end = n * (chunk + 1) / n_chunks;
+        iterator it = first;
+        std::advance(it, begin);
+        for (std::size_t i = begin; i < end; ++i, ++it) {
+          if (!check_case_(i, *it, expected, t, failures[chunk])) ++failed[chunk];
+        }
+      };
+      auto check_all = [&] { work_stealing_run_(n_chunks, jobs, check_chunk); };
+      try {
+        call_test_(main_buffer_, tid, check_all);
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [](std::ostream& os) { os << "  expected all cases to pass"; });
+      }
+      std::size_t total_failed = 0;
+      for (std::size_t f : failed) total_failed += f;
+      if (total_failed == 0) {
+        pass_(main_buffer_, tid);
+        return true;
+      }
+      std::ostream& os = fail_(main_buffer_, tid);
+      os << "  " << total_failed << " of " << n << " cases failed:\n";
+      std::size_t reported = 0;
+      for (auto const& chunk : failures) {
+        for (auto const& failure : chunk) {
+          if (reported == max_reported_cases_) break;
+          os << failure.message;
+          ++reported;
+        }
+      }
+      if (reported < total_failed) {
+        os << "  and " << (total_failed - reported) << " more.\n";
+      }
+      return false;
+    }
+
+    /** Execute a property-based test: predicate(generator(random)) is expected to
+     * be true for n random inputs. The generator builds an input from a
+     * UnitTester::Random, its only source of randomness, and the predicate
+     * checks it. A predicate or generator throwing counts as a failure.
+     * When the property fails, the failing input is shrunk to a smaller input
+     * which still fails, by replaying smaller random draws, and reported with
+     * the seed reproducing the run.
+     * With batch_jobs() greater than 1, the cases are checked in parallel, so the
+     * generator and predicate must then be safe to call concurrently. The first
+     * failing case is the same whatever the number of threads.
+     * The input is written by UnitTester::Formatter.
+     * This runs immediately even in deferred mode, like expect_all().
+     * @param id A string identifying this test in the output.
+     * @param generator A callable returning an input from a UnitTester::Random&.
+     * @param predicate A callable returning true if the property holds for an input.
+     * @param n The number of random inputs to check.
+     * @return true if the property held for all the inputs.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_property("abs is non-negative",
+     *       [](UnitTester::Random& r) { return r.in_range(-1000, 1000); },
+     *       [](int x) { return std::abs(x) >= 0; });
+     */
+    template <typename Generator, typename Predicate>
+    bool expect_property(std::string_view id, Generator generator, Predicate predicate, std::size_t n = 1000) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      uint64_t seed = property_seed_ ^ stable_hash_(tid.text);
+      std::size_t failed = n;
+      std::vector<uint64_t> draws;
+      std::size_t shrinks = 0;
+      auto check_all = [&] {
+        failed = first_failing_case_(generator, predicate, seed, n);
+        if (failed == n) return;
+        // Records the draws of the failing case, then shrinks them
+        Random random(case_seed_(seed, failed));
+        random.record_ = &draws;
+        property_holds_(generator, predicate, random);
+        shrinks = shrink_(generator, predicate, draws);
+      };
+      try {
+        call_test_(main_buffer_, tid, check_all);
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [](std::ostream& os) { os << "  expected the property to hold"; });
+      }
+      if (failed == n) {
+        pass_(main_buffer_, tid);
+        return true;
+      }
+      std::ostream& os = fail_(main_buffer_, tid);
+      {
+        local_iostream_flags f(os);
+        os << "  property failed on case " << (failed + 1) << " of " << n << " with property_seed(0x"
+           << std::hex << property_seed_ << ")";
+      }
+      os << ", counterexample after " << shrinks << " shrinks:\n    ";
+      describe_counterexample_(os, generator, predicate, draws);
+      return false;
+    }
+
+    /** Execute a concurrency stress test: for each of stress_iterations()
+     * iterations, a new object is made, body(object, thread, random) is called
+     * on stress_threads() threads at once, and check(object) is expected to
+     * return true once they all returned.
+     * The threads are created once, wait at a barrier before each iteration,
+     * and start after a random delay, so that their interleavings vary. The
+     * random generator of each thread can drive the operations of its body and
+     * insert more delays with jitter().
+     * This runs immediately even in deferred mode, on its own threads.
+     * @param id A string identifying this test in the output.
+     * @param make_object A callable returning a new shared object.
+     * @param body A callable taking the object, the index of the thread and a UnitTester::Random&.
+     * @param check A callable returning true if the object is in a valid state.
+     * @return true if check() returned true after every iteration, and nothing threw.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_stress("counter",
+     *       [] { return std::atomic<int>(0); },
+     *       [](std::atomic<int>& n, unsigned, UnitTester::Random&) { for (int i = 0; i < 100; ++i) ++n; },
+     *       [&](std::atomic<int> const& n) { return n == 100 * int(test.stress_threads()); });
+     */
+    template <typename MakeObject, typename Body, typename Check>
+    bool expect_stress(std::string_view id, MakeObject make_object, Body body, Check check) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      using Object = decltype(make_object());
+      std::size_t iterations = stress_iterations_;
+      std::size_t failed = iterations;
+      std::string error;
+      auto stress = [&] {
+        Object* current = nullptr;
+        stress_errors errors(stress_threads_);
+        std::vector<Random> randoms = stress_randoms_(tid, stress_threads_);
+        auto run = [&](unsigned thread) {
+          Random& random = randoms[thread];
+          try {
+            jitter(random);
+            body(*current, thread, random);
+          } catch (...) {
+            errors.add(thread, std::current_exception());
+          }
+        };
+        stress_crew<decltype(run)> crew(stress_threads_, run);
+        for (std::size_t i = 0; i < iterations; ++i) {
+          auto object = make_object();
+          current = &object;
+          crew.run();
+          if (errors.any()) error = errors.describe();
+          else if (!check(static_cast<Object const&>(object))) error = "check failed";
+          if (!error.empty()) {
+            failed = i;
+            return;
+          }
+        }
+      };
+      try {
+        call_test_(main_buffer_, tid, stress);
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [](std::ostream& os) { os << "  expected no failure"; });
+      }
+      if (failed == iterations) {
+        pass_(main_buffer_, tid);
+        return true;
+      }
+      fail_(main_buffer_, tid) << "  " << error << " after iteration " << (failed + 1) << " of " << iterations
+                               << " with " << stress_threads_ << " threads.\n";
+      return false;
+    }
+
+    /** Execute a linearizability test of a concurrent object: for each of
+     * stress_iterations() iterations, a new object is made, and each of
+     * stress_threads() threads applies operations operations to it at once.
+     * The history of their results and of their durations is expected to be
+     * explained by some sequential order of the operations, consistent with
+     * their real time order, applied to a copy of the model.
+     * Operations are values of any type made by generate(random, thread), and
+     * applied with apply(object, operation) concurrently, and with
+     * apply_model(model, operation) sequentially while checking. Both must
+     * return comparable results. The operations of a thread are made before it
+     * starts, and the results are kept in logs allocated once for the whole
+     * test, so recording costs two reads of the clock per operation.
+     * The search of an order is exponential in the number of threads, so
+     * histories should stay short: operations is 4 by default. When the model
+     * is equality comparable, the states already explored are remembered.
+     * This runs immediately even in deferred mode, on its own threads.
+     * @param id A string identifying this test in the output.
+     * @param make_object A callable returning a new concurrent object.
+     * @param model The sequential model in its initial state, copied for each order tried.
+     * @param generate A callable returning an operation from a UnitTester::Random& and the index of the thread.
+     * @param apply A callable applying an operation to the concurrent object, returning its result.
+     * @param apply_model A callable applying an operation to the model, returning its result.
+     * @param operations The number of operations of each thread in each iteration.
+     * @return true if every history was linearizable, and nothing threw.
+     * Example:
+     *     struct push_or_pop { bool push; int value; };
+     *     UnitTester test;
+     *
+     *     test.expect_linearizable("stack",
+     *       [] { return LockFreeStack<int>(); },
+     *       std::vector<int>(),
+     *       [](UnitTester::Random& r, unsigned) { return push_or_pop { r.coin(), r.in_range(0, 9) }; },
+     *       [](LockFreeStack<int>& s, push_or_pop op) { return op.push ? (s.push(op.value), -1) : s.pop_or(-1); },
+     *       [](std::vector<int>& s, push_or_pop op) {
+     *         if (op.push) { s.push_back(op.value); return -1; }
+     *         if (s.empty()) return -1;
+     *         int top = s.back();
+     *         s.pop_back();
+     *         return top;
+     *       });
+     */
+    template <typename MakeObject, typename Model, typename Generate, typename Apply, typename ApplyModel>
+    bool expect_linearizable(std::string_view id, MakeObject make_object, Model const& model, Generate generate,
+                             Apply apply, ApplyModel apply_model, std::size_t operations = 4) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      using Object = decltype(make_object());
+      using Operation = decltype(generate(std::declval<Random&>(), 0u));
+      using Result = decltype(apply(std::declval<Object&>(), std::declval<Operation const&>()));
+      static_assert(!std::is_void_v<Result>, "the operations of expect_linearizable() must return their results");
+      using Log = operation_log<Operation, Result>;
+      std::size_t iterations = stress_iterations_;
+      std::size_t failed = iterations;
+      std::string error;
+      std::vector<Log> logs(stress_threads_);
+      for (Log& log : logs) {
+        log.operations.reserve(operations);
+        log.events.reserve(operations);
+      }
+      auto stress = [&] {
+        Object* current = nullptr;
+        stress_errors errors(stress_threads_);
+        std::vector<Random> randoms = stress_randoms_(tid, stress_threads_);
+        auto run = [&](unsigned thread) {
+          Random& random = randoms[thread];
+          Log& log = logs[thread];
+          log.operations.clear();
+          log.events.clear();
+          try {
+            for (std::size_t k = 0; k < operations; ++k) log.operations.push_back(generate(random, thread));
+            jitter(random);
+            for (Operation const& operation : log.operations) {
+              int64_t invoked = std::chrono::steady_clock::now().time_since_epoch().count();
+              Result result = apply(*current, operation);
+              int64_t returned = std::chrono::steady_clock::now().time_since_epoch().count();
+              log.events.push_back(typename Log::event { std::move(result), invoked, returned });
+              jitter(random);
+            }
+          } catch (...) {
+            errors.add(thread, std::current_exception());
+          }
+        };
+        stress_crew<decltype(run)> crew(stress_threads_, run);
+        linearizability_search<Model, ApplyModel, Log> search(apply_model, logs, operations);
+        for (std::size_t i = 0; i < iterations; ++i) {
+          auto object = make_object();
+          current = &object;
+          crew.run();
+          if (errors.any()) {
+            error = "  " + errors.describe() + "\n";
+          } else if (!search.linearizable(model)) {
+            std::ostringstream os;
+            os.copyfmt(out_);
+            os << "  the history is not linearizable:\n";
+            describe_history_(os, logs);
+            error = os.str();
+          }
+          if (!error.empty()) {
+            failed = i;
+            return;
+          }
+        }
+      };
+      try {
+        call_test_(main_buffer_, tid, stress);
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [](std::ostream& os) { os << "  expected no failure"; });
+      }
+      if (failed == iterations) {
+        pass_(main_buffer_, tid);
+        return true;
+      }
+      fail_(main_buffer_, tid) << "  iteration " << (failed + 1) << " of " << iterations << " with "
+                               << stress_threads_ << " threads failed.\n" << error;
+      return false;
+    }
+
+    /** Waits for a short random time, up to a few hundred nanoseconds, and
+     * sometimes yields the processor, to vary the interleavings of threads. */
+    static void jitter(Random& random) {
+      uint64_t r = random.next();
+      for (uint64_t spins = r & 0xff; spins > 0; --spins) do_not_optimize(spins);
+      if ((r >> 8 & 0xf) == 0) std::this_thread::yield();
+    }
+
+    /** Execute a test that is expected to return an array of floating point values
+     * close to the expected ones.
+     * The values a and e are close if |a - e| <= abs_tol + rel_tol * |e|. NaN
+     * values are never close to anything.
+     * The number of values which are not close, and the largest error with its
+     * index, are reported on failure.
+     * The comparison is written so that compilers vectorize it on any target.
+     * This runs immediately even in deferred mode, so that the expected values
+     * are not copied.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester.
+     * @param id A string identifying this test case in the output.
+     * @param expected A contiguous container of the expected values, like a std::vector<double>.
+     * @param t A callable returning a contiguous container of the same type of values.
+     * @param rel_tol The tolerance relative to the expected value.
+     * @param abs_tol The absolute tolerance, 0 by default.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_all_close("fft roundtrip", signal, [&] { return ifft(fft(signal)); }, 1e-12, 1e-15);
+     */
+    template <typename Container, typename Test>
+    bool expect_all_close(std::string_view id, Container const& expected, Test t, double rel_tol, double abs_tol = 0) {
+      using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*std::data(expected))>>;
+      value_type rel = static_cast<value_type>(rel_tol);
+      value_type abs = static_cast<value_type>(abs_tol);
+      return check_close_(id, expected, ref_(t), close_compare_<value_type> { rel, abs });
+    }
+
+    /** Execute a test that is expected to return an array of floating point values
+     * within a number of units in the last place (ULP) of the expected ones.
+     * The distance in ULP is the number of representable values between two
+     * values, so it tolerates the same relative error at any magnitude. Zeros of
+     * both signs are equal, and NaN values are never close to anything.
+     * Otherwise this works like expect_all_close().
+     * @param id A string identifying this test case in the output.
+     * @param expected A contiguous container of the expected values, like a std::vector<double>.
+     * @param t A callable returning a contiguous container of the same type of values.
+     * @param max_ulps The maximum distance in ULP.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_all_close_ulp("fast exp", reference, [&] { return fast_exp(inputs); }, 4);
+     */
+    template <typename Container, typename Test>
+    bool expect_all_close_ulp(std::string_view id, Container const& expected, Test t, uint64_t max_ulps) {
+      using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*std::data(expected))>>;
+      return check_close_(id, expected, ref_(t), ulp_compare_<value_type> { max_ulps });
+    }
+
+    /** Execute a test that is expected to write the content of a golden file.
+     * The producer writes to a std::ostream which compares each chunk of 64 KB
+     * with the golden file as it comes, so the output is never stored whole.
+     * With UnitTesterMapping.hpp the golden file is mapped in memory, else it is
+     * read in chunks too. On failure, the offset of the first difference and the
+     * sizes are reported, with a hexadecimal dump of the expected and found
+     * bytes around it.
+     * With update_goldens(true), the output is written to the golden file
+     * instead, through a temporary file renamed when complete.
+     * @param id A string identifying this test case in the output.
+     * @param path The path of the golden file, opened in binary mode.
+     * @param producer A callable taking a std::ostream& and writing the output to check.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_matches_golden("export", "golden/export.json", [&](std::ostream& os) { exporter.write(os); });
+     */
+    template <typename Producer>
+    bool expect_matches_golden(std::string_view id, std::string const& path, Producer producer) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      if (deferred_) {
+        return defer_(tid, [this, path, producer = std::move(producer)](result_buffer& out, test_id checked_id) mutable {
+          return check_golden_(out, checked_id, path, producer);
+        });
+      }
+      return check_golden_(main_buffer_, tid, path, producer);
+    }
+
+    /** Measure the time taken by a callable.
+     * The number of iterations per sample is first calibrated so that a sample
+     * lasts at least benchmark_sample_time(), then a warm-up sample is run and
+     * discarded, then benchmark_samples() samples are measured.
+     * The value returned by the callable, if any, is passed to do_not_optimize(),
+     * whose indirect call is part of the measured time.
+     * The mean, median and 99th percentile of the time per iteration are output
+     * to the std::ostream associated with this UnitTester.
+     * Benchmarks always run immediately, even in deferred mode, since running
+     * other tests at the same time would distort the measure.
+     * @param id A string identifying this benchmark in the output.
+     * @param t The callable to measure.
+     * @return the statistics of the measure.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.benchmark("sqrt", [x = 2.0] { return std::sqrt(x); });
+     */
+    template <typename Test>
+    BenchmarkResult benchmark(std::string_view id, Test t) {
+      call_scope scope(*this);
+      BenchmarkResult result { std::string(id), 0, 0, 0, 0, {} };
+      test_id tid = intern_(id);
+      if (skip_(tid)) return result;
+      try {
+        result = measure_(id, t);
+        benchmark_stats_(main_buffer_.add(tid, Status::benchmark), result);
+      } catch (std::exception& e) {
+        main_buffer_.add(tid, Status::benchmark) << "  interrupted by exception: " << e.what() << '\n';
+      } catch (...) {
+        main_buffer_.add(tid, Status::benchmark) << "  interrupted by exception not derived from std::exception\n";
+      }
+      return result;
+    }
+
+    /** Execute a test that is expected to run within a time budget.
+     * The callable is measured like in benchmark(), and the test succeeds if the
+     * median time per iteration is at most the budget.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester, followed by the statistics of the measure.
+     * Like benchmark(), this runs immediately even in deferred mode.
+     * @param id A string identifying this test case in the output.
+     * @param budget_ns The maximum time per iteration, in nanoseconds.
+     * @param t The callable to measure.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_faster_than("fast sqrt", 50, [x = 2.0] { return std::sqrt(x); });
+     */
+    template <typename Test>
+    bool expect_faster_than(std::string_view id, double budget_ns, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      try {
+        BenchmarkResult result = measure_(id, t);
+        bool success = (result.median_ns <= budget_ns);
+        if (success) {
+          std::ostream& os = pass_(main_buffer_, tid);
+          if (!hide_pass_) benchmark_stats_(os, result);
+        } else {
+          std::ostream& os = fail_(main_buffer_, tid);
+          benchmark_stats_(os, result);
+          os << "  median exceeds the budget of " << budget_ns << " ns.\n";
+        }
+        return success;
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [budget_ns](std::ostream& os) {
+          os << "  expected a time under " << budget_ns << " ns";
+        });
+      }
+    }
+
+    /** Execute a test that is expected not to be slower than in the baseline.
+     * The callable is measured like in benchmark(), and the test fails only if
+     * its samples are significantly slower than the baseline samples of the same
+     * id by more than baseline_tolerance(), according to a one-sided Mann-Whitney
+     * U test at the baseline_alpha() level. This is much less sensitive to noise
+     * than a fixed threshold. The test passes if there is no baseline for this id.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester, followed by the statistics of the measure.
+     * Like benchmark(), this runs immediately even in deferred mode.
+     * @param id A string identifying this test case in the output and the baseline.
+     * @param t The callable to measure.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.load_baseline("bench.csv");
+     *     test.expect_no_regression("sort 1000", [&v] { auto w = v; std::sort(w.begin(), w.end()); return w; });
+     *     test.save_baseline("bench.csv");
+     */
+    template <typename Test>
+    bool expect_no_regression(std::string_view id, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      try {
+        BenchmarkResult result = measure_(id, t);
+        auto baseline = baseline_.find(result.id);
+        if (baseline == baseline_.end() || baseline->second.empty()) {
+          std::ostream& os = pass_(main_buffer_, tid);
+          if (!hide_pass_) {
+            benchmark_stats_(os, result);
+            os << "  no baseline to compare to.\n";
+          }
+          return true;
+        }
+        std::vector<double> scaled(result.samples_ns);
+        for (double& sample : scaled) sample /= 1 + baseline_tolerance_;
+        double p = mann_whitney_p_(scaled, baseline->second);
+        std::vector<double> const& old_samples = baseline->second;
+        double old_median = old_samples[old_samples.size() / 2];
+        bool success = (p >= baseline_alpha_);
+        std::ostream& os = success ? pass_(main_buffer_, tid) : fail_(main_buffer_, tid);
+        if (!success || !hide_pass_) {
+          benchmark_stats_(os, result);
+          local_iostream_flags f(os);
+          os << std::fixed;
+          os.precision(1);
+          os << "  baseline median " << old_median << " ns, ";
+          os.precision(4);
+          os << "p = " << p << (success ? "\n" : ", significantly slower.\n");
+        }
+        return success;
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [](std::ostream& os) { os << "  expected no regression"; });
+      }
+    }
+
+    /** Measure how a parallel callable scales: for each input size and each
+     * number of threads, the threads call t(size, thread, threads) at once, each
+     * doing its share of the work on an input of this size, and the time until
+     * they all return is measured like in benchmark(), with benchmark_samples()
+     * samples calibrated to last benchmark_sample_time(). The threads are
+     * created once for each number of threads, the calling thread being thread
+     * 0. The value returned by the callable, if any, is passed to
+     * do_not_optimize().
+     * A table of the median times, of the throughputs in items of the input per
+     * second, and of the parallel efficiencies is output to the std::ostream
+     * associated with this UnitTester, and given to its Reporter as the message
+     * of the benchmark, followed by the complexity best fitting the times with
+     * the fewest threads among O(1), O(n), O(n log n) and O(n^2).
+     * Like benchmark(), this runs immediately even in deferred mode.
+     * @param id A string identifying this benchmark in the output.
+     * @param sizes The sizes of the inputs.
+     * @param threads The numbers of threads, each at least 1.
+     * @param t The callable to measure.
+     * @return the points measured, and the complexity.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.benchmark_sweep("parallel sum", {1 << 16, 1 << 20}, {1, 2, 4},
+     *       [&](std::size_t n, unsigned thread, unsigned threads) {
+     *         return std::accumulate(data + n * thread / threads, data + n * (thread + 1) / threads, 0.0);
+     *       });
+     */
+    template <typename Test>
+    SweepResult benchmark_sweep(std::string_view id, std::vector<std::size_t> const& sizes,
+                                std::vector<unsigned> const& threads, Test t) {
+      call_scope scope(*this);
+      SweepResult result { std::string(id), {}, {} };
+      test_id tid = intern_(id);
+      if (skip_(tid)) return result;
+      try {
+        result = sweep_(id, sizes, threads, t);
+        sweep_table_(main_buffer_.add(tid, Status::benchmark), result);
+      } catch (std::exception& e) {
+        main_buffer_.add(tid, Status::benchmark) << "  interrupted by exception: " << e.what() << '\n';
+      } catch (...) {
+        main_buffer_.add(tid, Status::benchmark) << "  interrupted by exception not derived from std::exception\n";
+      }
+      return result;
+    }
+
+    /** Execute a test that a parallel callable scales: it is measured like in
+     * benchmark_sweep(), and the test succeeds if the parallel efficiency of
+     * every point is at least min_efficiency. The efficiency of a point is the
+     * time with the fewest threads on the same size, times their number,
+     * divided by the time of the point times its number of threads.
+     * A PASS or FAIL indication will be output to the std::ostream associated with
+     * this UnitTester, followed by the table of the sweep.
+     * Like benchmark(), this runs immediately even in deferred mode.
+     * @param id A string identifying this test case in the output.
+     * @param sizes The sizes of the inputs.
+     * @param threads The numbers of threads, each at least 1.
+     * @param min_efficiency The minimum parallel efficiency, like 0.7.
+     * @param t The callable to measure.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_scaling("parallel sort", {1 << 20}, {1, 2, 4}, 0.6,
+     *       [&](std::size_t n, unsigned thread, unsigned threads) { sorter.sort_part(n, thread, threads); });
+     */
+    template <typename Test>
+    bool expect_scaling(std::string_view id, std::vector<std::size_t> const& sizes, std::vector<unsigned> const& threads,
+                        double min_efficiency, Test t) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      try {
+        SweepResult result = sweep_(id, sizes, threads, t);
+        SweepPoint const* worst = nullptr;
+        for (SweepPoint const& point : result.points) {
+          if (!worst || point.efficiency < worst->efficiency) worst = &point;
+        }
+        bool success = !worst || worst->efficiency >= min_efficiency;
+        std::ostream& os = success ? pass_(main_buffer_, tid) : fail_(main_buffer_, tid);
+        if (!success || !hide_pass_) sweep_table_(os, result);
+        if (!success) {
+          local_iostream_flags f(os);
+          os << std::fixed;
+          os.precision(2);
+          os << "  efficiency " << worst->efficiency << " with " << worst->threads << " threads on size "
+             << worst->size << " is below " << min_efficiency << ".\n";
+        }
+        return success;
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [min_efficiency](std::ostream& os) {
+          os << "  expected an efficiency of " << min_efficiency;
+        });
+      }
+    }
+
+    /** Execute a test of the tail latency of a callable: it is called samples
+     * times, each call is timed into a LatencyHistogram, and the test succeeds
+     * if the given percentile of the latencies is at most the budget.
+     * The calls follow each other in a closed loop, after a warm-up of 1% of
+     * the samples. Each measure includes the reading of the clock, about 20 ns
+     * on common systems.
+     * The percentiles 50, 90, 99 and 99.9 and the maximum are output like the
+     * statistics of benchmarks. Like benchmark(), this runs immediately even
+     * in deferred mode.
+     * @param id A string identifying this test case in the output.
+     * @param percentile The fraction of the calls which must be within budget, like 0.99.
+     * @param budget_ns The maximum latency at this percentile, in nanoseconds.
+     * @param t The callable to measure.
+     * @param samples The number of calls measured.
+     * @return true if the test succeeded.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_percentile_below("lookup p99", 0.99, 200, [&] { return cache.find(key); });
+     */
+    template <typename Test>
+    bool expect_percentile_below(std::string_view id, double percentile, double budget_ns, Test t,
+                                 std::size_t samples = 10000) {
+      return check_percentile_(id, percentile, budget_ns, t, samples, std::chrono::nanoseconds(0));
+    }
+
+    /** Execute a test of the tail latency of a callable under an open-loop load:
+     * call i is scheduled at i * interval from the start, and its latency is
+     * counted from its scheduled time rather than from when it could start. So
+     * calls delayed by a slow one are not omitted from the measure, as they
+     * would be in a closed loop: this is the coordinated omission correction.
+     * Otherwise like expect_percentile_below(id, percentile, budget_ns, t, samples).
+     * @param interval The time between the scheduled starts of two calls.
+     * Example:
+     *     UnitTester test;
+     *
+     *     test.expect_percentile_below("handler at 10k/s", 0.999, 2e6, [&] { return handle(request); },
+     *                                  100000, std::chrono::microseconds(100));
+     */
+    template <typename Test>
+    bool expect_percentile_below(std::string_view id, double percentile, double budget_ns, Test t,
+                                 std::size_t samples, std::chrono::nanoseconds interval) {
+      return check_percentile_(id, percentile, budget_ns, t, samples, interval);
+    }
+
+  private:
+    // Result of the comparison of two arrays of floating point values. The
+    // error is the absolute difference, or the distance in ULP.
+    template <typename E>
+    struct close_result {
+      std::size_t mismatches;
+      E max_error;
+      std::size_t max_index;
+    };
+
+    // Unsigned integer of the same size as a float or a double
+    template <typename T>
+    using float_bits_ = std::conditional_t<sizeof(T) == 8, uint64_t, uint32_t>;
+
+    template <typename T>
+    static float_bits_<T> bits_of_(T x) {
+      static_assert(sizeof(T) == sizeof(float_bits_<T>), "only float and double are supported");
+      float_bits_<T> bits;
+      std::memcpy(&bits, &x, sizeof(x));
+      return bits;
+    }
+
+    // The comparison loops below have no branch and only reductions the
+    // compilers know how to vectorize. The maximum of non-negative floating point
+    // values is computed on their bits, which have the same order, since
+    // compilers do not reorder floating point maximums, NaN being unordered.
+
+    template <typename T>
+    static close_result<T> close_errors_(T const* e, T const* a, std::size_t n, T rel_tol, T abs_tol) {
+      std::size_t mismatches = 0;
+      float_bits_<T> max_bits = 0;
+      for (std::size_t i = 0; i < n; ++i) {
+        T error = std::abs(a[i] - e[i]);
+        mismatches += !(error <= abs_tol + rel_tol * std::abs(e[i]));
+        float_bits_<T> bits = bits_of_(error);
+        max_bits = (bits > max_bits) ? bits : max_bits;
+      }
+      close_result<T> result { mismatches, 0, 0 };
+      std::memcpy(&result.max_error, &max_bits, sizeof(max_bits));
+      for (std::size_t i = 0; mismatches > 0 && i < n; ++i) {
+        if (bits_of_(std::abs(a[i] - e[i])) == max_bits) {
+          result.max_index = i;
+          break;
+        }
+      }
+      return result;
+    }
+
+    // Distance in ULP, with all NaN values at the maximum distance
+    template <typename T>
+    static uint64_t ulp_distance_(T x, T y) {
+      using bits = float_bits_<T>;
+      constexpr bits sign = bits(1) << (sizeof(T) * 8 - 1);
+      // Maps the sign and magnitude representation to an ordered unsigned one
+      bits bx = bits_of_(x);
+      bits by = bits_of_(y);
+      bits ox = (bx & sign) ? bits(~bx + 1) : bits(bx | sign);
+      bits oy = (by & sign) ? bits(~by + 1) : bits(by | sign);
+      uint64_t distance = (ox > oy) ? uint64_t(ox - oy) : uint64_t(oy - ox);
+      bool nan = (x != x) || (y != y);
+      return nan ? std::numeric_limits<uint64_t>::max() : distance;
+    }
+
+    template <typename T>
+    static close_result<uint64_t> ulp_errors_(T const* e, T const* a, std::size_t n, uint64_t max_ulps) {
+      std::size_t mismatches = 0;
+      uint64_t max_distance = 0;
+      for (std::size_t i = 0; i < n; ++i) {
+        uint64_t distance = ulp_distance_(e[i], a[i]);
+        mismatches += (distance > max_ulps);
+        max_distance = (distance > max_distance) ? distance : max_distance;
+      }
+      close_result<uint64_t> result { mismatches, max_distance, 0 };
+      for (std::size_t i = 0; mismatches > 0 && i < n; ++i) {
+        if (ulp_distance_(e[i], a[i]) == max_distance) {
+          result.max_index = i;
+          break;
+        }
+      }
+      return result;
+    }
+
+    // The comparisons of expect_all_close() and expect_all_close_ulp()
+    template <typename T>
+    struct close_compare_ {
+      T rel_tol;
+      T abs_tol;
+      close_result<T> operator()(T const* e, T const* a, std::size_t n) const {
+        return close_errors_(e, a, n, rel_tol, abs_tol);
+      }
+    };
+    template <typename T>
+    struct ulp_compare_ {
+      uint64_t max_ulps;
+      close_result<uint64_t> operator()(T const* e, T const* a, std::size_t n) const {
+        return ulp_errors_(e, a, n, max_ulps);
+      }
+    };
+
+    // The common part of expect_all_close() and expect_all_close_ulp()
+    template <typename Container, typename R, typename Compare>
+    bool check_close_(std::string_view id, Container const& expected, callable_ref<R()> t, Compare compare) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      try {
+        R actual = timed_(main_buffer_, tid, t);
+        std::size_t n = std::size(expected);
+        if (std::size(actual) != n) {
+          fail_(main_buffer_, tid) << "  expected " << n << " values, found " << std::size(actual) << " instead.\n";
+          return false;
+        }
+        auto result = compare(std::data(expected), std::data(actual), n);
+        if (result.mismatches == 0) {
+          pass_(main_buffer_, tid);
+          return true;
+        }
+        std::ostream& os = fail_(main_buffer_, tid);
+        local_iostream_flags f(os);
+        os.precision(std::numeric_limits<std::remove_cv_t<std::remove_reference_t<decltype(*std::data(expected))>>>::max_digits10);
+        std::size_t i = result.max_index;
+        os << "  " << result.mismatches << " of " << n << " values differ, max error " << result.max_error
+           << " at index " << i << " (expected " << std::data(expected)[i] << ", found " << std::data(actual)[i] << ")\n";
+        return false;
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [](std::ostream& os) { os << "  expected close values"; });
+      }
+    }
+
+    template <typename T, typename = void>
+    struct is_printable_ : std::false_type { };
+    template <typename T>
+    struct is_printable_<T, std::void_t<decltype(std::declval<std::ostream&>() << std::declval<T const&>())>>
+    : std::true_type { };
+    template <typename T, typename = void>
+    struct is_range_ : std::false_type { };
+    template <typename T>
+    struct is_range_<T, std::void_t<decltype(std::begin(std::declval<T const&>()))>> : std::true_type { };
+
+    // Bounds of the values formatted by default
+    static constexpr std::size_t max_formatted_characters_ = 256;
+    static constexpr std::size_t max_formatted_elements_ = 32;
+
+    // A value written by its Formatter, for use in an expression like os << formatted_(value)
+    template <typename T>
+    struct formatted_value {
+      T const& value;
+      friend std::ostream& operator<<(std::ostream& os, formatted_value f) {
+        Formatter<T>::format(os, f.value);
+        return os;
+      }
+    };
+    template <typename T>
+    static formatted_value<T> formatted_(T const& value) { return formatted_value<T> { value }; }
+
+    // Bound of the number of predicate evaluations made to shrink a counterexample
+    static constexpr std::size_t max_shrink_attempts_ = 5000;
+
+    static uint64_t case_seed_(uint64_t seed, std::size_t i) { return seed + i * 0xd1b54a32d192ed03ull; }
+
+    template <typename Generator, typename Predicate>
+    static bool property_holds_(Generator& generator, Predicate& predicate, Random& random) {
+      try {
+        return static_cast<bool>(predicate(generator(random)));
+      } catch (...) {
+        return false;
+      }
+    }
+
+    // Returns the index of the first case of the property which fails, or n.
+    // Each case is generated from its own seed, so cases can be checked in
+    // parallel chunks, each stopping at its first failure or when a failure was
+    // found in an earlier case.
+    template <typename Generator, typename Predicate>
+    std::size_t first_failing_case_(Generator& generator, Predicate& predicate, uint64_t seed, std::size_t n) {
+      unsigned jobs = batch_jobs_;
+      std::size_t n_chunks = (jobs > 1) ? std::min<std::size_t>(n, jobs * std::size_t(8)) : (n > 0);
+      std::atomic<std::size_t> first_failure(n);
+      auto check_chunk = [&](unsigned, std::size_t chunk) {
+        Random random(0);
+        std::size_t end = n * (chunk + 1) / n_chunks;
+        for (std::size_t i = n * chunk / n_chunks; i < end && i < first_failure.load(std::memory_order_relaxed); ++i) {
+          random.seed(case_seed_(seed, i));
+          if (!property_holds_(generator, predicate, random)) {
+            std::size_t current = first_failure.load();
+            while (i < current && !first_failure.compare_exchange_weak(current, i)) { }
+            return;
+          }
+        }
+      };
+      work_stealing_run_(n_chunks, jobs, check_chunk);
+      return first_failure;
+    }
+
+    // Shrinks the draws of a failing case while it still fails: removes blocks
+    // of draws, then searches the smallest failing value of each draw, until
+    // nothing changes. Returns the number of successful shrinks.
+    template <typename Generator, typename Predicate>
+    static std::size_t shrink_(Generator& generator, Predicate& predicate, std::vector<uint64_t>& draws) {
+      std::size_t attempts = 0;
+      std::size_t shrinks = 0;
+      std::vector<uint64_t> candidate;
+      auto fails = [&](std::vector<uint64_t> const& d) {
+        ++attempts;
+        Random replay(0);
+        replay.replay_ = &d;
+        return !property_holds_(generator, predicate, replay);
+      };
+      bool improved = true;
+      while (improved && attempts < max_shrink_attempts_) {
+        improved = false;
+        for (std::size_t size = 8; size > 0; size /= 2) {
+          std::size_t i = 0;
+          while (i + size <= draws.size() && attempts < max_shrink_attempts_) {
+            candidate.assign(draws.begin(), draws.begin() + i);
+            candidate.insert(candidate.end(), draws.begin() + i + size, draws.end());
+            if (fails(candidate)) {
+              draws.swap(candidate);
+              ++shrinks;
+              improved = true;
+            } else {
+              ++i;
+            }
+          }
+        }
+        for (std::size_t i = 0; i < draws.size() && attempts < max_shrink_attempts_; ++i) {
+          candidate = draws;
+          uint64_t low = 0;
+          uint64_t high = draws[i];
+          while (low < high && attempts < max_shrink_attempts_) {
+            uint64_t middle = low + (high - low) / 2;
+            candidate[i] = middle;
+            if (fails(candidate)) high = middle; else low = middle + 1;
+          }
+          if (high < draws[i]) {
+            draws[i] = high;
+            ++shrinks;
+            improved = true;
+          }
+        }
+      }
+      return shrinks;
+    }
+
+    // Outputs the input given by the shrunk draws, and how the predicate fails on it
+    template <typename Generator, typename Predicate>
+    static void describe_counterexample_(std::ostream& os, Generator& generator, Predicate& predicate,
+                                         std::vector<uint64_t> const& draws) {
+      Random replay(0);
+      replay.replay_ = &draws;
+      try {
+        auto input = generator(replay);
+        os << formatted_(input);
+        try {
+          if (predicate(input)) os << "\n  which passes when checked again: the property is not deterministic";
+        } catch (std::exception& e) {
+          os << "\n  on which the predicate throws: " << e.what();
+        } catch (...) {
+          os << "\n  on which the predicate throws an exception not derived from std::exception";
+        }
+      } catch (std::exception& e) {
+        os << "(the generator throws: " << e.what() << ")";
+      } catch (...) {
+        os << "(the generator throws an exception not derived from std::exception)";
+      }
+      os << '\n';
+    }
+
+    template <typename Test>
+    struct is_async_ : std::bool_constant<AsyncResult<std::decay_t<std::invoke_result_t<Test&>>>::is_async> { };
+
+    // An asynchronous test waiting for its result
+    struct async_check {
+      queued_id id;
+      std::chrono::steady_clock::time_point started;
+      std::chrono::steady_clock::time_point deadline;
+
+      async_check(test_id i, std::chrono::nanoseconds timeout)
+      : id(i), started(std::chrono::steady_clock::now()),
+        deadline(timeout.count() > 0 ? started + timeout : std::chrono::steady_clock::time_point::max()) { }
+      virtual ~async_check() { }
+      virtual bool ready() = 0;
+      virtual void wait(std::chrono::nanoseconds d) = 0;
+      // Records the result of the test
+      virtual bool finish(result_buffer& out) = 0;
+    };
+
+    template <typename Future, typename Check>
+    struct async_test final : async_check {
+      Future future;
+      Check check;
+
+      async_test(test_id i, std::chrono::nanoseconds timeout, Future&& f, Check& c)
+      : async_check(i, timeout), future(std::move(f)), check(std::move(c)) { }
+      // Deferred futures are ready: getting their value runs them
+      bool ready() override { return future.wait_for(std::chrono::seconds(0)) != std::future_status::timeout; }
+      void wait(std::chrono::nanoseconds d) override { future.wait_for(d); }
+      bool finish(result_buffer& out) override {
+        auto get = [this]() -> decltype(auto) { return future.get(); };
+        return check(out, id.get(), get);
+      }
+    };
+
+    // Starts an asynchronous test, which check(out, id, get) records once get()
+    // returns its value without waiting. The value of a test throwing before
+    // returning its future is the exception, recorded immediately.
+    template <typename Test, typename Check>
+    bool start_async_(test_id id, Test& t, Check check) {
+      using Adapter = AsyncResult<std::decay_t<decltype(t())>>;
+      using Future = decltype(Adapter::start(t()));
+      std::exception_ptr error;
+      try {
+        Future future = Adapter::start(t());
+        async_tests_.emplace_back(new async_test<Future, Check>(id, main_buffer_.timeout(), std::move(future), check));
+        return true;
+      } catch (...) {
+        error = std::current_exception();
+      }
+      auto get = [&error]() -> decltype(std::declval<Future&>().get()) { std::rethrow_exception(error); };
+      return check(main_buffer_, id, get);
+    }
+
+    // Barrier reused by the threads of a stress test. Waiting spins for a while,
+    // then yields, so that it also works with more threads than cores.
+    class stress_barrier {
+      private:
+        unsigned const n_;
+        std::atomic<unsigned> arrived_;
+        std::atomic<unsigned> generation_;
+      public:
+        explicit stress_barrier(unsigned n) : n_(n), arrived_(0), generation_(0) { }
+        void wait() {
+          unsigned generation = generation_.load(std::memory_order_acquire);
+          if (arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 == n_) {
+            arrived_.store(0, std::memory_order_relaxed);
+            generation_.fetch_add(1, std::memory_order_release);
+            return;
+          }
+          for (unsigned spins = 0; generation_.load(std::memory_order_acquire) == generation; ++spins) {
+            if (spins >= 64) std::this_thread::yield();
+          }
+        }
+    };
+
+    // Threads calling body(thread) at once for each call to run(). The calling
+    // thread is thread 0, the others are created once and wait at a barrier
+    // between iterations.
+    template <typename Body>
+    class stress_crew {
+      private:
+        Body& body_;
+        stress_barrier barrier_;
+        bool stop_;
+        std::vector<std::thread> threads_;
+      public:
+        stress_crew(unsigned n, Body& body) : body_(body), barrier_(n), stop_(false), threads_() {
+          threads_.reserve(n - 1);
+          for (unsigned i = 1; i < n; ++i) {
+            threads_.emplace_back([this, i] {
+              for (;;) {
+                barrier_.wait();
+                if (stop_) return;
+                body_(i);
+                barrier_.wait();
+              }
+            });
+          }
+        }
+        ~stress_crew() {
+          stop_ = true;
+          barrier_.wait();
+          for (std::thread& t : threads_) t.join();
+        }
+        stress_crew(stress_crew const&) = delete;
+        stress_crew& operator=(stress_crew const&) = delete;
+
+        void run() {
+          barrier_.wait();
+          body_(0);
+          barrier_.wait();
+        }
+    };
+
+    // Exceptions thrown by the threads of a stress test in an iteration
+    class stress_errors {
+      private:
+        std::vector<std::exception_ptr> errors_;
+        std::atomic<bool> any_;
+      public:
+        explicit stress_errors(unsigned threads) : errors_(threads), any_(false) { }
+        void add(unsigned thread, std::exception_ptr e) {
+          errors_[thread] = e;
+          any_ = true;
+        }
+        bool any() const { return any_; }
+        std::string describe() const {
+          for (std::size_t thread = 0; thread < errors_.size(); ++thread) {
+            if (!errors_[thread]) continue;
+            std::string text = "thread " + std::to_string(thread) + " got exception";
+            try {
+              std::rethrow_exception(errors_[thread]);
+            } catch (std::exception& e) {
+              return text + ": " + e.what();
+            } catch (...) {
+              return text + " not derived from std::exception";
+            }
+          }
+          return std::string();
+        }
+    };
+
+    // The random generators of the threads of a stress test
+    std::vector<Random> stress_randoms_(test_id id, unsigned threads) const {
+      std::vector<Random> randoms;
+      randoms.reserve(threads);
+      uint64_t seed = property_seed_ ^ stable_hash_(id.text);
+      for (unsigned i = 0; i < threads; ++i) randoms.emplace_back(case_seed_(seed, i));
+      return randoms;
+    }
+
+    // The operations of a thread of expect_linearizable(), and their results
+    // with the times they were invoked and returned, in nanoseconds
+    template <typename Operation, typename Result>
+    struct operation_log {
+      struct event {
+        Result result;
+        int64_t invoked;
+        int64_t returned;
+      };
+      std::vector<Operation> operations;
+      std::vector<event> events;
+    };
+
+    template <typename T, typename = void>
+    struct is_equality_comparable_ : std::false_type { };
+    template <typename T>
+    struct is_equality_comparable_<T, std::void_t<decltype(std::declval<T const&>() == std::declval<T const&>())>>
+    : std::true_type { };
+
+    // Depth first search of a sequential order of the operations of a history,
+    // in the manner of Wing and Gong. Each thread applied its operations in
+    // order, so the operations already ordered are given by a cursor per thread.
+    // The next operation of a thread can come next if it was invoked before
+    // every other pending operation returned. When the model is equality
+    // comparable, the states from which no order exists are remembered with
+    // their cursors, as in the algorithm of Lowe.
+    template <typename Model, typename ApplyModel, typename Log>
+    class linearizability_search {
+      private:
+        static constexpr bool memoized = is_equality_comparable_<Model>::value;
+        ApplyModel& apply_model_;
+        std::vector<Log> const& logs_;
+        std::vector<std::size_t> cursors_;
+        uint64_t radix_;
+        bool keyed_;
+        std::unordered_map<uint64_t, std::vector<Model>> dead_ends_;
+
+        uint64_t key_() const {
+          uint64_t key = 0;
+          for (std::size_t i = 0; i < logs_.size(); ++i) key = key * radix_ + cursors_[i];
+          return key;
+        }
+
+        bool search_(Model const& state, std::size_t pending) {
+          if (pending == 0) return true;
+          if constexpr (memoized) {
+            if (keyed_) {
+              auto it = dead_ends_.find(key_());
+              if (it != dead_ends_.end() && std::find(it->second.begin(), it->second.end(), state) != it->second.end()) {
+                return false;
+              }
+            }
+          }
+          int64_t first_return = std::numeric_limits<int64_t>::max();
+          for (std::size_t i = 0; i < logs_.size(); ++i) {
+            if (cursors_[i] < logs_[i].events.size()) first_return = std::min(first_return, logs_[i].events[cursors_[i]].returned);
+          }
+          for (std::size_t i = 0; i < logs_.size(); ++i) {
+            std::size_t k = cursors_[i];
+            if (k >= logs_[i].events.size() || logs_[i].events[k].invoked > first_return) continue;
+            Model next = state;
+            if (!(apply_model_(next, logs_[i].operations[k]) == logs_[i].events[k].result)) continue;
+            ++cursors_[i];
+            bool found = search_(next, pending - 1);
+            --cursors_[i];
+            if (found) return true;
+          }
+          if constexpr (memoized) {
+            if (keyed_) dead_ends_[key_()].push_back(state);
+          }
+          return false;
+        }
+
+      public:
+        linearizability_search(ApplyModel& apply_model, std::vector<Log> const& logs, std::size_t operations)
+        : apply_model_(apply_model), logs_(logs), cursors_(logs.size()), radix_(operations + 1), keyed_(true), dead_ends_()
+        {
+          // The cursors must fit in the keys
+          uint64_t states = 1;
+          for (std::size_t i = 0; i < logs.size() && keyed_; ++i) {
+            keyed_ = states <= std::numeric_limits<uint64_t>::max() / radix_;
+            states *= radix_;
+          }
+        }
+
+        bool linearizable(Model const& model) {
+          std::fill(cursors_.begin(), cursors_.end(), 0);
+          dead_ends_.clear();
+          std::size_t pending = 0;
+          for (Log const& log : logs_) pending += log.events.size();
+          return search_(model, pending);
+        }
+    };
+
+    // Outputs the operations of a history, their results, and the times they
+    // were invoked and returned relative to the first one
+    template <typename Log>
+    static void describe_history_(std::ostream& os, std::vector<Log> const& logs) {
+      int64_t start = std::numeric_limits<int64_t>::max();
+      for (Log const& log : logs) {
+        if (!log.events.empty()) start = std::min(start, log.events.front().invoked);
+      }
+      for (std::size_t i = 0; i < logs.size(); ++i) {
+        for (std::size_t k = 0; k < logs[i].events.size(); ++k) {
+          auto const& e = logs[i].events[k];
+          os << "    thread " << i << ": " << formatted_(logs[i].operations[k]) << " -> " << formatted_(e.result)
+             << " (from " << (e.invoked - start) << " to " << (e.returned - start) << " ns)\n";
+        }
+      }
+    }
+
+    // Whether calling Test is a constant expression
+    template <auto& Test, typename = void>
+    struct is_constant_call_ : std::false_type { };
+    template <auto& Test>
+    struct is_constant_call_<Test, std::void_t<std::integral_constant<bool, (static_cast<void>(Test()), true)>>>
+    : std::true_type { };
+
+    // A failing case of expect_all(), with its formatted message
+    struct case_failure {
+      std::size_t index;
+      std::string message;
+    };
+
+    // Checks one case of expect_all(), recording its failure if it is among the
+    // first of its chunk
+    template <typename Input, typename Expected, typename Test>
+    bool check_case_(std::size_t i, Input const& x, Expected& expected, Test& t, std::vector<case_failure>& failures) {
+      bool report = failures.size() < max_reported_cases_;
+      try {
+        auto expected_result = expected(x);
+        auto test_value = t(x);
+        if (test_value == expected_result) return true;
+        if (report) {
+          std::ostringstream os;
+          os.copyfmt(out_);
+          os << "  [" << i << "] expected value " << formatted_(expected_result) << ", found " << formatted_(test_value)
+             << " instead.\n";
+          failures.push_back(case_failure { i, os.str() });
+        }
+      } catch (std::exception& e) {
+        if (report) {
+          failures.push_back(case_failure { i, "  [" + std::to_string(i) + "] got exception: " + e.what() + "\n" });
+        }
+      } catch (...) {
+        if (report) {
+          failures.push_back(case_failure { i, "  [" + std::to_string(i) + "] got exception not derived from std::exception\n" });
+        }
+      }
+      return false;
+    }
+
+    // Calls the benchmarked callable once, keeping its result if any
+    template <typename Test>
+    static void invoke_kept_(Test& t) {
+      if constexpr (std::is_void_v<decltype(t())>) {
+        t();
+      } else {
+        do_not_optimize(t());
+      }
+    }
+
+    // Returns the time taken by a number of calls to the benchmarked callable
+    template <typename Test>
+    static std::chrono::nanoseconds time_batch_(Test& t, uintmax_t iterations) {
+      auto start = std::chrono::steady_clock::now();
+      for (uintmax_t i = 0; i < iterations; ++i) {
+        invoke_kept_(t);
       }
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
     }
 
-    // Counts a FAIL and prints fail message
-    void fail_(std::string const& id) {
-      ++count_fail_;
-      out_ << red_() << "☒  FAIL  " << reset_() << id << '\n';
+    // Calibrates, warms up and samples the benchmarked callable
+    template <typename Test>
+    BenchmarkResult measure_(std::string_view id, Test& t) {
+      uintmax_t iterations = 1;
+      // The cap stops the calibration of callables the compiler reduced to nothing
+      while (time_batch_(t, iterations) < benchmark_sample_time_ && iterations < (uintmax_t(1) << 30)) {
+        iterations *= 2;
+      }
+      time_batch_(t, iterations);
+      BenchmarkResult result { std::string(id), iterations, 0, 0, 0, {} };
+      result.samples_ns.reserve(benchmark_samples_);
+      for (std::size_t i = 0; i < benchmark_samples_; ++i) {
+        double elapsed = static_cast<double>(time_batch_(t, iterations).count());
+        result.samples_ns.push_back(elapsed / static_cast<double>(iterations));
+      }
+      std::sort(result.samples_ns.begin(), result.samples_ns.end());
+      double sum = 0;
+      for (double sample : result.samples_ns) sum += sample;
+      std::size_t n = result.samples_ns.size();
+      result.mean_ns = sum / static_cast<double>(n);
+      result.median_ns = (n % 2) ? result.samples_ns[n / 2]
+                                 : (result.samples_ns[n / 2 - 1] + result.samples_ns[n / 2]) / 2;
+      result.p99_ns = result.samples_ns[static_cast<std::size_t>(std::ceil(0.99 * static_cast<double>(n))) - 1];
+      benchmark_results_.push_back(result);
+      return result;
     }
 
-    // RAII thing to save and restore iostream flags in a scope
-    class local_iostream_flags {
-      private:
-        std::ios_base& io_;
-        std::ios::fmtflags f_;
-      public:
-        local_iostream_flags(std::ios_base& io) : io_(io), f_(io_.flags()) { }
-        ~local_iostream_flags() { io_.flags(f_); }
-    };
-
-  public:
-    /** Create a UnitTester instance, with output to the specified std::ostream,
-     * by default std::cout. */
-    UnitTester(std::ostream& out = std::cout)
-    : out_(out), count_pass_(0), count_fail_(0), count_skip_(0),
-      color_output_(true), hide_pass_(false), filter_()
-    { }
+    // Measures the points of a sweep, throwing the first exception of a thread
+    template <typename Test>
+    SweepResult sweep_(std::string_view id, std::vector<std::size_t> const& sizes, std::vector<unsigned> const& threads,
+                       Test& t) {
+      SweepResult result { std::string(id), std::vector<SweepPoint>(sizes.size() * threads.size()), {} };
+      for (std::size_t k = 0; k < threads.size(); ++k) {
+        unsigned n_threads = std::max(threads[k], 1u);
+        std::size_t size = 0;
+        uintmax_t iterations = 1;
+        stress_errors errors(n_threads);
+        auto run = [&](unsigned thread) {
+          auto share = [&t, &size, thread, n_threads] { return t(size, thread, n_threads); };
+          try {
+            for (uintmax_t i = 0; i < iterations; ++i) invoke_kept_(share);
+          } catch (...) {
+            errors.add(thread, std::current_exception());
+          }
+        };
+        stress_crew<decltype(run)> crew(n_threads, run);
+        auto time_round = [&] {
+          auto start = std::chrono::steady_clock::now();
+          crew.run();
+          auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+          if (errors.any()) throw std::runtime_error(errors.describe());
+          return elapsed;
+        };
+        for (std::size_t s = 0; s < sizes.size(); ++s) {
+          size = sizes[s];
+          iterations = 1;
+          while (time_round() < benchmark_sample_time_ && iterations < (uintmax_t(1) << 30)) iterations *= 2;
+          time_round();
+          std::vector<double> samples;
+          samples.reserve(benchmark_samples_);
+          for (std::size_t i = 0; i < benchmark_samples_; ++i) {
+            samples.push_back(static_cast<double>(time_round().count()) / static_cast<double>(iterations));
+          }
+          std::sort(samples.begin(), samples.end());
+          std::size_t n = samples.size();
+          double median = (n % 2) ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+          double throughput = median > 0 ? static_cast<double>(size) * 1e9 / median : 0;
+          result.points[s * threads.size() + k] = SweepPoint { size, n_threads, median, throughput, 1 };
+        }
+      }
+      // Efficiencies relative to the fewest threads, and complexity with them
+      std::vector<SweepPoint const*> bases;
+      for (std::size_t s = 0; s < sizes.size(); ++s) {
+        auto first = result.points.begin() + static_cast<std::ptrdiff_t>(s * threads.size());
+        auto last = first + static_cast<std::ptrdiff_t>(threads.size());
+        auto base = std::min_element(first, last, [](SweepPoint const& a, SweepPoint const& b) { return a.threads < b.threads; });
+        if (base == last) continue;
+        for (auto point = first; point != last; ++point) {
+          double work = point->time_ns * point->threads;
+          point->efficiency = work > 0 ? base->time_ns * base->threads / work : 1;
+        }
+        bases.push_back(&*base);
+      }
+      result.complexity = fit_complexity_(bases);
+      sweep_results_.push_back(result);
+      return result;
+    }
 
-    /** Returns the number of tests passed so far in this UnitTester instance. */
-    uintmax_t count_pass() const { return count_pass_; }
-    /** Returns the number of tests failed so far in this UnitTester instance. */
-    uintmax_t count_fail() const { return count_fail_; }
+    // Returns the model of complexity minimizing the relative errors of the
+    // times of the points, with the constant fitted by least squares
+    static std::string fit_complexity_(std::vector<SweepPoint const*> const& points) {
+      std::vector<std::size_t> sizes;
+      for (SweepPoint const* point : points) sizes.push_back(point->size);
+      std::sort(sizes.begin(), sizes.end());
+      if (std::unique(sizes.begin(), sizes.end()) - sizes.begin() < 3) return std::string();
+      struct model {
+        char const* name;
+        double (*f)(double);
+      };
+      static constexpr model models[] = {
+        { "O(1)", [](double) { return 1.0; } },
+        { "O(n)", [](double n) { return n; } },
+        { "O(n log n)", [](double n) { return n * std::log2(std::max(n, 2.0)); } },
+        { "O(n^2)", [](double n) { return n * n; } },
+      };
+      char const* best = "";
+      double best_error = std::numeric_limits<double>::infinity();
+      for (model const& m : models) {
+        // Minimizes the sum of (1 - c f(n) / time)^2
+        double sum = 0;
+        double sum_squares = 0;
+        for (SweepPoint const* point : points) {
+          if (point->time_ns <= 0) continue;
+          double ratio = m.f(static_cast<double>(point->size)) / point->time_ns;
+          sum += ratio;
+          sum_squares += ratio * ratio;
+        }
+        if (sum_squares <= 0) continue;
+        double c = sum / sum_squares;
+        double error = 0;
+        for (SweepPoint const* point : points) {
+          if (point->time_ns <= 0) continue;
+          double relative = 1 - c * m.f(static_cast<double>(point->size)) / point->time_ns;
+          error += relative * relative;
+        }
+        if (error < best_error) {
+          best = m.name;
+          best_error = error;
+        }
+      }
+      return best;
+    }
 
-    /** Outputs a count of passed tests, and failed tests if any test failed. */
-    void summary() {
-      if (count_skip_ > 0) {
-        out_ << count_skip_ << " tests skipped.\n";
+    // Outputs the points of a sweep as a table, and its complexity
+    static void sweep_table_(std::ostream& os, SweepResult const& result) {
+      local_iostream_flags f(os);
+      os << "  " << std::left << std::setw(12) << "size" << std::setw(9) << "threads" << std::right << std::setw(14)
+         << "time ns" << std::setw(14) << "items/s" << std::setw(12) << "efficiency" << '\n';
+      for (SweepPoint const& point : result.points) {
+        os << "  " << std::left << std::setw(12) << point.size << std::setw(9) << point.threads << std::right
+           << std::fixed << std::setprecision(1) << std::setw(14) << point.time_ns << std::scientific
+           << std::setprecision(3) << std::setw(14) << point.throughput << std::fixed << std::setprecision(2)
+           << std::setw(12) << point.efficiency << '\n';
       }
-      out_ << count_pass_ << " tests passed.\n";
-      if (count_fail_ > 0) {
-        out_ << count_fail_ << " tests " << red_() << "FAILED !" << reset_() << '\n';
+      if (!result.complexity.empty()) os << "  complexity " << result.complexity << " with the fewest threads\n";
+    }
+
+    template <typename Test>
+    bool check_percentile_(std::string_view id, double percentile, double budget_ns, Test& t, std::size_t samples,
+                           std::chrono::nanoseconds interval) {
+      call_scope scope(*this);
+      test_id tid = intern_(id);
+      if (skip_(tid)) return false;
+      try {
+        LatencyHistogram histogram;
+        for (std::size_t i = 0; i < samples / 100 + 1; ++i) invoke_kept_(t);
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < samples; ++i) {
+          auto scheduled = start + interval * static_cast<int64_t>(i);
+          auto begin = std::chrono::steady_clock::now();
+          if (interval.count() > 0) {
+            // A late call still counts from its scheduled time
+            while (begin < scheduled) begin = std::chrono::steady_clock::now();
+            begin = scheduled;
+          }
+          invoke_kept_(t);
+          histogram.record(static_cast<uint64_t>((std::chrono::steady_clock::now() - begin).count()));
+        }
+        uint64_t measured = histogram.percentile(percentile);
+        bool success = static_cast<double>(measured) <= budget_ns;
+        std::ostream& os = success ? pass_(main_buffer_, tid) : fail_(main_buffer_, tid);
+        if (!success || !hide_pass_) {
+          latency_stats_(os, histogram);
+          if (!success) {
+            os << "  p" << percentile * 100 << " of " << measured << " ns exceeds the budget of " << budget_ns << " ns.\n";
+          }
+        }
+        return success;
+      } catch (...) {
+        return failed_by_exception_(main_buffer_, tid, [budget_ns](std::ostream& os) {
+          os << "  expected a latency under " << budget_ns << " ns";
+        });
       }
     }
 
-    /** Returns whether color output is enabled. */
-    bool color_output() const { return color_output_; }
-    /** Enable or disable color output. Enabled by default. */
-    UnitTester& color_output(bool c) { color_output_ = c; return *this; }
+    // Outputs the percentiles of a latency histogram
+    static void latency_stats_(std::ostream& os, LatencyHistogram const& histogram) {
+      os << "  p50 " << histogram.percentile(0.5) << " ns, p90 " << histogram.percentile(0.9)
+         << " ns, p99 " << histogram.percentile(0.99) << " ns, p99.9 " << histogram.percentile(0.999)
+         << " ns, max " << histogram.max() << " ns (" << histogram.count() << " samples)\n";
+    }
 
-    UnitTester& hide_pass() { hide_pass_ = true; return *this; }
-    UnitTester& show_pass() { hide_pass_ = false; return *this; }
+    // One-sided Mann-Whitney U test: returns the probability of observing
+    // samples a at least this much larger than samples b if they came from the
+    // same distribution. Uses the normal approximation with tie correction,
+    // which is accurate enough for the usual tens of samples.
+    static double mann_whitney_p_(std::vector<double> const& a, std::vector<double> const& b) {
+      std::vector<std::pair<double, bool>> all;
+      all.reserve(a.size() + b.size());
+      for (double x : a) all.emplace_back(x, true);
+      for (double x : b) all.emplace_back(x, false);
+      std::sort(all.begin(), all.end(),
+        [](std::pair<double, bool> const& x, std::pair<double, bool> const& y) { return x.first < y.first; });
+      double rank_sum_a = 0;
+      double ties = 0;
+      for (std::size_t i = 0; i < all.size(); ) {
+        std::size_t j = i;
+        while (j < all.size() && all[j].first == all[i].first) ++j;
+        double rank = (static_cast<double>(i + j) + 1) / 2;
+        for (std::size_t k = i; k < j; ++k) {
+          if (all[k].second) rank_sum_a += rank;
+        }
+        double t = static_cast<double>(j - i);
+        ties += t * t * t - t;
+        i = j;
+      }
+      double n1 = static_cast<double>(a.size());
+      double n2 = static_cast<double>(b.size());
+      double n = n1 + n2;
+      double u = rank_sum_a - n1 * (n1 + 1) / 2;
+      double variance = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)));
+      if (variance <= 0) return u > n1 * n2 / 2 ? 0 : 1;
+      double z = (u - n1 * n2 / 2 - 0.5) / std::sqrt(variance);
+      return 0.5 * std::erfc(z / std::sqrt(2.0));
+    }
 
-    /** Run tests only if a specified condition is true.
-     * The id string of a test is passed to the function.
-     * A call to only_if replaces the previous condition.
-     * The condition is always true by default. */
-    UnitTester& only_if(decltype(filter_) f) {
-      filter_ = f;
-      return *this;
+    // Outputs the statistics of a benchmark
+    static void benchmark_stats_(std::ostream& os, BenchmarkResult const& result) {
+      local_iostream_flags f(os);
+      os << std::fixed;
+      os.precision(1);
+      os << "  mean " << result.mean_ns << " ns, median " << result.median_ns << " ns, p99 "
+           << result.p99_ns << " ns (" << result.samples_ns.size() << " samples of "
+           << result.iterations << " iterations)\n";
     }
 
-    /** Remove any condition set by only_if(). */
-    UnitTester& always() {
-      decltype(filter_) empty_func;
-      filter_.swap(empty_func);
-      return *this;
+    // The tests themselves, recording their results in out, which is the buffer
+    // of the thread running the test. They take the test callable as a
+    // callable_ref, so they are compiled once for each type of value, not for
+    // each callable.
+    bool check_bool_(result_buffer& out, test_id id, bool value, callable_ref<bool()> t) {
+      return check_value_(out, id, value, t);
     }
 
-    /** Execute a test that is expected to return the boolean value true.
-     * A PASS or FAIL indication will be output to the std::ostream associated with
-     * this UnitTester
-     * @param id A string identifying this test case in the output.
-     * @param t A callable that is expected to return true if the test is successful.
-     * @return true if the test succeeded.
-     * Example:
-     *     UnitTester test;
-     *
-     *     test("1+1 equals 2").expect_true([] {
-     *       return 1+1 == 2;
-     *     });
-     */
-    template <typename Test>
-    bool expect_true(std::string const& id, Test t) {
-      if (filter_ && !filter_(id)) { ++count_skip_; return false; }
-      local_iostream_flags f(out_);
-      out_ << std::boolalpha;
-      return expect_value(id, true, [&t] { return !!t(); });
+    // What a test expected, and the reports of wrong values. They depend only
+    // on the types of the values, so they are shared by the tests of these types.
+    template <typename T>
+    struct expected_value {
+      T const& value;
+      void operator()(std::ostream& os) const { os << "  expected value " << formatted_(value); }
+    };
+    template <typename T>
+    struct expected_range {
+      T const& min;
+      T const& max;
+      void operator()(std::ostream& os) const { os << "  expected a value in [" << formatted_(min) << ", " << formatted_(max) << ']'; }
+    };
+
+    template <typename T, typename Value>
+    bool wrong_value_(result_buffer& out, test_id id, T const& value, Value const& test_value) {
+      fail_(out, id) << "  expected value " << formatted_(value) << ", found " << formatted_(test_value) << " instead.\n";
+      return false;
     }
 
-    /** Execute a test that is expected to return the boolean value false.
-     * A PASS or FAIL indication will be output to the std::ostream associated with
-     * this UnitTester
-     * @param id A string identifying this test case in the output.
-     * @param t A callable that is expected to return false if the test is successful.
-     * @return true if the test succeeded.
-     * Example:
-     *     UnitTester test;
-     *
-     *     test.expect_false("1+1 does not equals 3", [] {
-     *       return 1+1 == 3;
-     *     });
-     */
-    template <typename Test>
-    bool expect_false(std::string const& id, Test t) {
-      if (filter_ && !filter_(id)) { ++count_skip_; return false; }
-      local_iostream_flags f(out_);
-      out_ << std::boolalpha;
-      return expect_value(id, false, [&t] { return !!t(); });
+    template <typename T, typename Value>
+    bool out_of_range_(result_buffer& out, test_id id, T const& min, T const& max, Value const& test_value) {
+      fail_(out, id) << "  value " << formatted_(test_value) << " is not in expected range ["
+                     << formatted_(min) << ", " << formatted_(max) << "]\n";
+      return false;
     }
 
-    /** Execute a test that is expected to return a specified value.
-     * A PASS or FAIL indication will be output to the std::ostream associated with
-     * this UnitTester
-     * @param id A string identifying this test case in the output.
-     * @param value The value expected to be returned.
-     * @param t A callable that is expected to return something equal to 'value' if
-     *          the test is successful.
-     * @return true if the test succeeded.
-     * Example:
-     *     UnitTester test;
-     *
-     *     test("1+1 equals 2").expect_value(2, [] { return 1+1; });
-     */
-    template <typename Test, typename T>
-    bool expect_value(std::string const& id, T const& value, Test t) {
-      if (filter_ && !filter_(id)) { ++count_skip_; return false; }
+    template <typename T, typename R>
+    bool check_value_(result_buffer& out, test_id id, T const& value, callable_ref<R()> t) {
       try {
-        auto test_value = t();
-        bool result = (test_value == value);
-        if (result) {
-          pass_(id);
-        } else {
-          fail_(id);
-          out_ << "  expected value " << value << ", found " << test_value << " instead.\n";
-        }
-        return result;
-      } catch(std::exception& e) {
-        fail_(id);
-        out_ << "  expected value " << value << ", got exception: " << e.what() << '\n';
-        return false;
+        R test_value = timed_(out, id, t);
+        if (!(test_value == value)) return wrong_value_(out, id, value, test_value);
+        pass_(out, id);
+        return true;
       } catch (...) {
-        fail_(id);
-        out_ << "  expected value " << value << ", got exception not derived from std::exception\n";
-        return false;
+        return failed_by_exception_(out, id, expected_value<T> { value });
       }
     }
 
-    /** Execute a test that is expected to return a value within a specified range.
-     * A PASS or FAIL indication will be output to the std::ostream associated with
-     * this UnitTester.
-     * The type of the value should implement usual comparison operators.
-     * Use with caution, since a test with a random result passing this once is not
-     * a guarantee that the test will always pass.
-     * Can be useful for testing floating point results.
-     * @param id A string identifying this test case in the output.
-     * @param min The minimum value expected to be returned (included).
-     * @param max The maximum value expected to be returned (included).
-     * @param t A callable that is expected to return a value within a range if the test is successful.
-     * @return true of the test succeeded.
-     * Example:
-     *     UnitTester test;
-     *
-     *     test.expect_in_range("rng test", 0, RAND_MAX, [] { return rand(); });
-     *     test("one third").expect_in_range(0.333, 0.334, []{ return 1.0 / 3.0; });
-     */
-    template <typename Test, typename T>
-    bool expect_in_range(std::string const& id, T const& min, T const& max, Test t) {
-      if (filter_ && !filter_(id)) { ++count_skip_; return false; }
+    template <typename T, typename R>
+    bool check_in_range_(result_buffer& out, test_id id, T const& min, T const& max, callable_ref<R()> t) {
       try {
-        auto test_value = t();
-        bool result = (min <= test_value && test_value <= max);
-        if (result) {
-          pass_(id);
-        } else {
-          fail_(id);
-          out_ << "  value " << test_value << " is not in expected range [" << min << ", " << max << "]\n";
-        }
-        return result;
-      } catch(std::exception& e) {
-        fail_(id);
-        out_ << "  expected a value in [" << min << ", " << max << "], got exception: " << e.what() << '\n';
-        return false;
+        R test_value = timed_(out, id, t);
+        if (!(min <= test_value && test_value <= max)) return out_of_range_(out, id, min, max, test_value);
+        pass_(out, id);
+        return true;
       } catch (...) {
-        fail_(id);
-        out_ << "  expected a value in [" << min << ", " << max << "], got exception not derived from std::exception\n";
-        return false;
+        return failed_by_exception_(out, id, expected_range<T> { min, max });
       }
     }
 
-    /** Execute a test that is expected to throw an exception of any type.
-     * A PASS or FAIL indication will be output to the std::ostream associated with
-     * this UnitTester
-     * @param id A string identifying this test case in the output.
-     * @param t A callable that is expected to throw an exception if the test is successful.
-     * @return true of the test succeeded.
-     * Example:
-     *     UnitTester test;
-     *
-     *     test.expect_any_exception("exception example", [] {
-     *       throw "something";
-     *     });
-     */
-    template <typename Test>
-    bool expect_any_exception(std::string const& id, Test t) {
-      if (filter_ && !filter_(id)) { ++count_skip_; return false; }
+    bool check_any_exception_(result_buffer& out, test_id id, callable_ref<void()> t) {
       bool exception_happened = false;
       try {
-        t();
+        call_test_(out, id, t);
+      } catch (deadline_missed&) {
+        return failed_by_exception_(out, id, [](std::ostream& os) { os << "  expected an exception"; });
       } catch (...) {
         exception_happened = true;
       }
       if (exception_happened) {
-        pass_(id);
+        pass_(out, id);
       } else {
-        fail_(id);
-        out_ << "  expected exception was not thrown.\n";
+        fail_(out, id) << "  expected exception was not thrown.\n";
       }
       return exception_happened;
     }
 
-    /** Execute a test that is expected to throw an exception of a specified type.
-     * The expected exception type is given as a template parameter of this method.
-     * A PASS or FAIL indication will be output to the std::ostream associated with
-     * this UnitTester
-     * @param id A string identifying this test case in the output.
-     * @param t A callable that is expected to throw an exception if the test is successful.
-     * @return true of the test succeeded.
-     * Example:
-     *     UnitTester test;
-     *
-     *     test.expect_exception<std::logic_error>("exception example", [] {
-     *       throw std::logic_error("this example is not realistic");
-     *     });
-     */
-    template <typename Except, typename Test>
-    bool expect_exception(std::string const& id, Test t) {
-      if (filter_ && !filter_(id)) { ++count_skip_; return false; }
+    template <typename Except>
+    bool check_exception_(result_buffer& out, test_id id, callable_ref<void()> t) {
       bool exception_happened = false;
       bool other_exception_happened = false;
       try {
-        t();
+        call_test_(out, id, t);
+      } catch (deadline_missed&) {
+        return failed_by_exception_(out, id, [](std::ostream& os) { os << "  expected an exception"; });
       } catch (Except& e) {
         exception_happened = true;
       } catch (...) {
         other_exception_happened = true;
       }
       if (exception_happened) {
-        pass_(id);
+        pass_(out, id);
       } else if (other_exception_happened) {
-        fail_(id);
-        out_ << "  an exception happened but not of the correct type.\n";
+        fail_(out, id) << "  an exception happened but not of the correct type.\n";
       } else {
-        fail_(id);
-        out_ << "  expected exception was not thrown.\n";
+        fail_(out, id) << "  expected exception was not thrown.\n";
       }
       return exception_happened;
     }
 
+    bool check_instructions_(result_buffer& out, test_id id, uint64_t max_count, callable_ref<void()> t) {
+      bool counted = false;
+      counter_values used { 0, 0, 0, 0 };
+      // Measured around the callable only, to exclude the framework
+      auto measured = [&t, &counted, &used] {
+        counter_values start;
+        bool started = read_counters_(start);
+        t();
+        counter_values end;
+        counted = started && read_counters_(end);
+        if (counted) used = counter_difference_(end, start);
+      };
+      try {
+        call_test_(out, id, measured);
+        if (!counted) {
+          skipped_(out, id) << "  hardware counters are not available, the instructions were not counted.\n";
+          return false;
+        }
+        if (used.instructions <= max_count) {
+          pass_(out, id);
+          return true;
+        }
+        fail_(out, id) << "  expected at most " << max_count << " instructions, got " << used.instructions
+                       << " (" << used.cycles << " cycles).\n";
+      } catch (...) {
+        failed_by_exception_(out, id, [max_count](std::ostream& os) { os << "  expected at most " << max_count << " instructions"; });
+      }
+      return false;
+    }
+
+    bool check_alloc_(result_buffer& out, test_id id, uint64_t max_count, callable_ref<void()> t) {
+      auto expected = [max_count](std::ostream& os) -> std::ostream& {
+        return max_count == 0 ? os << "  expected no allocation" : os << "  expected at most " << max_count << " allocations";
+      };
+      if (!allocations_counted_) {
+        expected(fail_(out, id)) << ", but allocations are not counted: UnitTesterAllocations.hpp is not included in the program.\n";
+        return false;
+      }
+      allocation_count used { 0, 0 };
+      // Measured around the callable only, to exclude the framework
+      auto measured = [&t, &used] {
+        allocation_count start = thread_allocations_;
+        t();
+        used = allocation_count { thread_allocations_.count - start.count, thread_allocations_.bytes - start.bytes };
+      };
+      try {
+        call_test_(out, id, measured);
+        if (used.count <= max_count) {
+          pass_(out, id);
+          return true;
+        }
+        expected(fail_(out, id)) << ", got " << used.count << " (" << used.bytes << " bytes).\n";
+      } catch (...) {
+        failed_by_exception_(out, id, expected);
+      }
+      return false;
+    }
+
+    // Read access to a golden file, mapped if possible, else read in chunks
+    class golden_file {
+      private:
+        mapped_file mapped_;
+        std::ifstream in_;
+        uint64_t size_;
+        uint64_t position_;
+        std::vector<char> chunk_;
+        bool open_;
+      public:
+        explicit golden_file(std::string const& path)
+        : mapped_ { nullptr, 0, nullptr }, in_(), size_(0), position_(0), chunk_(), open_(false)
+        {
+          if (file_mapper_ && file_mapper_(path, mapped_)) {
+            size_ = mapped_.size;
+            open_ = true;
+            return;
+          }
+          in_.open(path, std::ios::binary | std::ios::ate);
+          if (!in_) return;
+          size_ = static_cast<uint64_t>(in_.tellg());
+          in_.seekg(0);
+          open_ = !!in_;
+        }
+        ~golden_file() { if (mapped_.unmap) mapped_.unmap(mapped_.data, mapped_.size); }
+        golden_file(golden_file const&) = delete;
+        golden_file& operator=(golden_file const&) = delete;
+
+        bool is_open() const { return open_; }
+        uint64_t size() const { return size_; }
+
+        // Returns the n bytes at offset, fewer at the end of the file. The view is
+        // valid until the next call.
+        std::string_view read(uint64_t offset, std::size_t n) {
+          if (offset >= size_) return std::string_view();
+          n = static_cast<std::size_t>(std::min<uint64_t>(n, size_ - offset));
+          if (mapped_.data) return std::string_view(mapped_.data + offset, n);
+          if (offset != position_) {
+            in_.clear();
+            in_.seekg(static_cast<std::streamoff>(offset));
+          }
+          chunk_.resize(n);
+          in_.read(chunk_.data(), static_cast<std::streamsize>(n));
+          std::size_t got = static_cast<std::size_t>(in_.gcount());
+          position_ = offset + got;
+          return std::string_view(chunk_.data(), got);
+        }
+    };
+
+    // Stream buffer comparing everything written to it with a golden file, a
+    // chunk at a time, and keeping the first bytes written from the first
+    // difference on, for the report
+    class golden_comparator : public std::streambuf {
+      public:
+        static constexpr uint64_t no_difference = std::numeric_limits<uint64_t>::max();
+        static constexpr std::size_t kept_bytes = 48;
+      private:
+        golden_file& golden_;
+        std::vector<char> buffer_;
+        uint64_t written_;
+        uint64_t difference_;
+        std::string found_;
+
+        void compare_(char const* s, std::size_t n) {
+          if (difference_ == no_difference) {
+            std::string_view expected = golden_.read(written_, n);
+            if (expected.size() != n || std::memcmp(expected.data(), s, n) != 0) {
+              std::size_t same = static_cast<std::size_t>(std::mismatch(expected.begin(), expected.end(), s).second - s);
+              difference_ = written_ + same;
+              s += same;
+              n -= same;
+              written_ += same;
+            }
+          }
+          if (difference_ != no_difference && found_.size() < kept_bytes) {
+            found_.append(s, std::min(n, kept_bytes - found_.size()));
+          }
+          written_ += n;
+        }
+
+        void compare_pending_() {
+          compare_(pbase(), static_cast<std::size_t>(pptr() - pbase()));
+          setp(buffer_.data(), buffer_.data() + buffer_.size());
+        }
+
+      protected:
+        int_type overflow(int_type c) override {
+          compare_pending_();
+          if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+          }
+          return traits_type::not_eof(c);
+        }
+        std::streamsize xsputn(char const* s, std::streamsize n) override {
+          if (n < epptr() - pptr()) {
+            std::memcpy(pptr(), s, static_cast<std::size_t>(n));
+            pbump(static_cast<int>(n));
+          } else {
+            // Large writes are compared in place
+            compare_pending_();
+            compare_(s, static_cast<std::size_t>(n));
+          }
+          return n;
+        }
+        int sync() override {
+          compare_pending_();
+          return 0;
+        }
+
+      public:
+        explicit golden_comparator(golden_file& golden)
+        : golden_(golden), buffer_(64 * 1024), written_(0), difference_(no_difference), found_()
+        {
+          setp(buffer_.data(), buffer_.data() + buffer_.size());
+        }
+
+        // Compares what remains, then the sizes. Returns the offset of the first
+        // difference, or no_difference.
+        uint64_t finish() {
+          compare_pending_();
+          if (difference_ == no_difference && written_ != golden_.size()) difference_ = written_;
+          return difference_;
+        }
+
+        uint64_t written() const { return written_; }
+        std::string const& found() const { return found_; }
+    };
+
+    // Outputs a line of a dump of 16 bytes at offset, preceded by a sign
+    static void hex_line_(std::ostream& os, char sign, uint64_t offset, std::string_view bytes) {
+      local_iostream_flags f(os);
+      char fill = os.fill('0');
+      os << "    " << sign << std::hex << std::setw(8) << offset << ' ';
+      for (std::size_t i = 0; i < 16; ++i) {
+        if (i < bytes.size()) os << ' ' << std::setw(2) << static_cast<unsigned>(static_cast<unsigned char>(bytes[i]));
+        else os << "   ";
+      }
+      os << "  |";
+      for (char c : bytes) os << (static_cast<unsigned char>(c) >= 0x20 && static_cast<unsigned char>(c) < 0x7f ? c : '.');
+      os << "|\n";
+      os.fill(fill);
+    }
+
+    bool check_golden_(result_buffer& out, test_id id, std::string const& path,
+                       callable_ref<void(std::ostream&)> producer) {
+      try {
+        if (update_goldens_) {
+          std::string temporary = path + ".tmp";
+          uint64_t size = 0;
+          bool written = false;
+          auto produce = [&] {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            producer(static_cast<std::ostream&>(file));
+            size = static_cast<uint64_t>(file.tellp());
+            file.close();
+            written = !!file;
+          };
+          call_test_(out, id, produce);
+          // rename() does not replace an existing file on some systems
+          if (written && std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(path.c_str());
+            written = std::rename(temporary.c_str(), path.c_str()) == 0;
+          }
+          if (!written) {
+            std::remove(temporary.c_str());
+            fail_(out, id) << "  cannot write the golden file " << path << ".\n";
+            return false;
+          }
+          std::ostream& os = pass_(out, id);
+          if (!hide_pass_) os << "  updated the golden file " << path << ", " << size << " bytes.\n";
+          return true;
+        }
+        golden_file golden(path);
+        if (!golden.is_open()) {
+          fail_(out, id) << "  cannot read the golden file " << path << ", written with update_goldens(true).\n";
+          return false;
+        }
+        golden_comparator comparator(golden);
+        uint64_t difference = golden_comparator::no_difference;
+        auto produce = [&] {
+          std::ostream os(&comparator);
+          producer(os);
+          difference = comparator.finish();
+        };
+        call_test_(out, id, produce);
+        if (difference == golden_comparator::no_difference) {
+          pass_(out, id);
+          return true;
+        }
+        std::ostream& os = fail_(out, id) << "  expected the content of " << path << ", found a difference at byte "
+                                          << difference << " of " << golden.size() << ", in an output of "
+                                          << comparator.written() << " bytes:\n";
+        // One line before the difference, and two from it. The bytes written
+        // before the difference are those of the golden file.
+        uint64_t start = difference / 16 * 16;
+        start -= std::min<uint64_t>(start, 16);
+        std::string found(golden.read(start, static_cast<std::size_t>(difference - start)));
+        found += comparator.found();
+        std::string expected(golden.read(start, golden_comparator::kept_bytes));
+        for (std::size_t line = 0; line < golden_comparator::kept_bytes; line += 16) {
+          std::string_view e = std::string_view(expected).substr(std::min(line, expected.size()), 16);
+          std::string_view f = std::string_view(found).substr(std::min(line, found.size()), 16);
+          if (e.empty() && f.empty()) break;
+          hex_line_(os, '-', start + line, e);
+          hex_line_(os, '+', start + line, f);
+        }
+      } catch (...) {
+        failed_by_exception_(out, id, [&path](std::ostream& os) { os << "  expected the content of " << path; });
+      }
+      return false;
+    }
+
+    bool check_peak_memory_(result_buffer& out, test_id id, uint64_t max_bytes, callable_ref<void()> t) {
+      auto expected = [max_bytes](std::ostream& os) -> std::ostream& {
+        return os << "  expected a peak of the heap of at most " << max_bytes << " bytes";
+      };
+      if (!allocations_counted_) {
+        expected(fail_(out, id)) << ", but allocations are not counted: UnitTesterAllocations.hpp is not included in the program.\n";
+        return false;
+      }
+      uint64_t peak = 0;
+      uint64_t rss_start = 0;
+      uint64_t rss_end = 0;
+      bool rss = false;
+      // Measured around the callable only, to exclude the framework
+      auto measured = [&] {
+        rss = rss_reader_ && rss_reader_(rss_start);
+        heap_peak_meter meter;
+        t();
+        peak = meter.peak();
+        rss = rss && rss_reader_(rss_end);
+      };
+      try {
+        call_test_(out, id, measured);
+        if (peak <= max_bytes) {
+          pass_(out, id);
+          return true;
+        }
+        std::ostream& os = expected(fail_(out, id)) << ", got " << peak << " bytes";
+        if (rss) {
+          os << ", while the resident set size grew by "
+             << (rss_end >= rss_start ? static_cast<int64_t>(rss_end - rss_start) : -static_cast<int64_t>(rss_start - rss_end))
+             << " bytes";
+        }
+        os << ".\n";
+      } catch (...) {
+        failed_by_exception_(out, id, expected);
+      }
+      return false;
+    }
+
+  public:
     // This class holds an id for a test and is returned by UnitTester::operator(),
     // which enables the notation test("test id").expect_value(42, [] { return 40 + 2; });
+    // The id is only a view, unless it was given as a temporary std::string, which
+    // is then moved into the namer.
     struct UnitTestNamer {
       UnitTester& tester;
-      std::string id;
-      UnitTestNamer(UnitTester& t, std::string const& i) : tester(t), id(i) { }
-      template <typename Test> bool expect_true(Test t) { return tester.expect_true(id, t); }
-      template <typename Test> bool expect_false(Test t) { return tester.expect_false(id, t); }
-      template <typename Test, typename T> bool expect_value(const T& value, Test t) { return tester.expect_value(id, value, t); }
+      std::string_view id;
+      std::string storage;
+      std::chrono::nanoseconds time_limit;
+      UnitTestNamer(UnitTester& t, std::string_view i) : tester(t), id(i), storage(), time_limit(0) { }
+      UnitTestNamer(UnitTester& t, std::string&& i) : tester(t), id(), storage(std::move(i)), time_limit(0) { id = storage; }
+      UnitTestNamer(UnitTestNamer const& n) : tester(n.tester), id(n.id), storage(n.storage), time_limit(n.time_limit) {
+        if (n.id.data() == n.storage.data()) id = storage;
+      }
+      /** Set the time limit of this test, instead of the one set by UnitTester::timeout(). */
+      UnitTestNamer& timeout(std::chrono::nanoseconds d) { time_limit = d; return *this; }
+      template <typename Test> bool expect_true(Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_true(id, std::move(t));
+      }
+      template <typename Test> bool expect_false(Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_false(id, std::move(t));
+      }
+      template <typename Test, typename T> bool expect_value(const T& value, Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_value(id, value, std::move(t));
+      }
+      template <auto& Test, typename T> bool expect_constexpr(T const& value) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_constexpr<Test>(id, value);
+      }
+      template <auto& Test> bool expect_constexpr() {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_constexpr<Test>(id);
+      }
       template <typename Test, typename T> bool expect_in_range(T const& min, T const& max, Test t) {
-        return tester.expect_in_range(id, min, max, t);
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_in_range(id, min, max, std::move(t));
+      }
+      template <typename Test> bool expect_any_exception(Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_any_exception(id, std::move(t));
+      }
+      template <typename Except, typename Test> bool expect_exception(Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_exception<Except>(id, std::move(t));
+      }
+      template <typename Test> bool expect_no_alloc(Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_no_alloc(id, std::move(t));
+      }
+      template <typename Test> bool expect_max_alloc(uint64_t max_count, Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_max_alloc(id, max_count, std::move(t));
+      }
+      template <typename Test> bool expect_peak_memory_below(uint64_t max_bytes, Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_peak_memory_below(id, max_bytes, std::move(t));
+      }
+      template <typename Producer> bool expect_matches_golden(std::string const& path, Producer producer) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_matches_golden(id, path, std::move(producer));
+      }
+      template <typename Test> bool expect_max_instructions(uint64_t max_count, Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_max_instructions(id, max_count, std::move(t));
+      }
+      template <typename Test> BenchmarkResult benchmark(Test t) { return tester.benchmark(id, t); }
+      template <typename Test> bool expect_faster_than(double budget_ns, Test t) {
+        return tester.expect_faster_than(id, budget_ns, t);
+      }
+      template <typename Test> bool expect_no_regression(Test t) { return tester.expect_no_regression(id, t); }
+      template <typename Test>
+      SweepResult benchmark_sweep(std::vector<std::size_t> const& sizes, std::vector<unsigned> const& threads, Test t) {
+        return tester.benchmark_sweep(id, sizes, threads, t);
+      }
+      template <typename Test>
+      bool expect_scaling(std::vector<std::size_t> const& sizes, std::vector<unsigned> const& threads,
+                          double min_efficiency, Test t) {
+        return tester.expect_scaling(id, sizes, threads, min_efficiency, t);
+      }
+      template <typename Test>
+      bool expect_percentile_below(double percentile, double budget_ns, Test t, std::size_t samples = 10000) {
+        return tester.expect_percentile_below(id, percentile, budget_ns, t, samples);
+      }
+      template <typename Test>
+      bool expect_percentile_below(double percentile, double budget_ns, Test t, std::size_t samples,
+                                   std::chrono::nanoseconds interval) {
+        return tester.expect_percentile_below(id, percentile, budget_ns, t, samples, interval);
+      }
+      template <typename Range, typename Expected, typename Test> bool expect_all(Range const& inputs, Expected expected, Test t) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_all(id, inputs, expected, t);
+      }
+      template <typename Generator, typename Predicate>
+      bool expect_property(Generator generator, Predicate predicate, std::size_t n = 1000) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_property(id, generator, predicate, n);
+      }
+      template <typename MakeObject, typename Body, typename Check>
+      bool expect_stress(MakeObject make_object, Body body, Check check) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_stress(id, make_object, body, check);
+      }
+      template <typename MakeObject, typename Model, typename Generate, typename Apply, typename ApplyModel>
+      bool expect_linearizable(MakeObject make_object, Model const& model, Generate generate, Apply apply,
+                               ApplyModel apply_model, std::size_t operations = 4) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_linearizable(id, make_object, model, generate, apply, apply_model, operations);
+      }
+      template <typename Container, typename Test>
+      bool expect_all_close(Container const& expected, Test t, double rel_tol, double abs_tol = 0) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_all_close(id, expected, t, rel_tol, abs_tol);
+      }
+      template <typename Container, typename Test> bool expect_all_close_ulp(Container const& expected, Test t, uint64_t max_ulps) {
+        timeout_scope scope(tester, time_limit);
+        return tester.expect_all_close_ulp(id, expected, t, max_ulps);
       }
-      template <typename Test> bool expect_any_exception(Test t) { return tester.expect_any_exception(id, t); }
-      template <typename Except, typename Test> bool expect_exception(Test t) { return tester.expect_exception<Except>(id, t); }
     };
-    UnitTestNamer operator()(std::string const& id) { return UnitTestNamer(*this, id); }
+    UnitTestNamer operator()(std::string_view id) { return UnitTestNamer(*this, id); }
+    UnitTestNamer operator()(char const* id) { return UnitTestNamer(*this, std::string_view(id)); }
+    UnitTestNamer operator()(std::string&& id) { return UnitTestNamer(*this, std::move(id)); }
 };
@@ -0,0 +1,107 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://www.mozilla.org/en-US/MPL/2.0/.
+ * Copyright © 2020 Yann Quelen */
+
+
+// Allocation counting for UnitTester.
+//
+// This header replaces the global operator new and operator delete of the
+// program, so it must be included in exactly one source file, typically the one
+// holding main(). Every allocation then adds to counters of the calling thread,
+// which UnitTester reads around test callables.
+//
+// To count the bytes in use, each block starts with a header holding its size,
+// of alignof(std::max_align_t) bytes, or of the alignment of the block if it is
+// larger. Blocks freed by another thread than the one allocating them are
+// subtracted from the bytes in use of the thread freeing them.
+//
+// Only the plain and aligned forms of operator new are replaced: the array and
+// nothrow forms call them by default. The aligned form uses std::aligned_alloc,
+// which the C library of the platform must provide.
+
+#pragma once
+
+#include "UnitTester.hpp"
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <new>
+
+class UnitTester::AllocationHook
+{
+  public:
+    // Tells UnitTester that allocations are counted. Called once at startup.
+    static bool install() {
+      allocations_counted_ = true;
+      return true;
+    }
+
+    static std::size_t header_size(std::size_t alignment) { return std::max(alignment, alignof(std::max_align_t)); }
+
+    static void* allocate(std::size_t size, std::size_t alignment) {
+      thread_allocations_.count += 1;
+      thread_allocations_.bytes += size;
+      std::size_t header = header_size(alignment);
+      if (size > std::numeric_limits<std::size_t>::max() - 2 * header) throw std::bad_alloc();
+      for (;;) {
+        void* p = nullptr;
+        if (alignment <= alignof(std::max_align_t)) {
+          p = std::malloc(header + size);
+        } else {
+          // The size given to aligned_alloc must be a multiple of the alignment
+          p = std::aligned_alloc(alignment, header + (size + alignment - 1) / alignment * alignment);
+        }
+        if (p) {
+          char* block = static_cast<char*>(p) + header;
+          std::memcpy(block - sizeof(std::size_t), &size, sizeof(std::size_t));
+          heap_usage& heap = thread_heap_;
+          heap.live += static_cast<int64_t>(size);
+          heap.peak = std::max(heap.peak, heap.live);
+          return block;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+      }
+    }
+
+    static void deallocate(void* p, std::size_t alignment) noexcept {
+      if (!p) return;
+      char* block = static_cast<char*>(p);
+      std::size_t size;
+      std::memcpy(&size, block - sizeof(std::size_t), sizeof(std::size_t));
+      thread_heap_.live -= static_cast<int64_t>(size);
+      std::free(block - header_size(alignment));
+    }
+};
+
+namespace {
+  bool const unit_tester_allocation_hook = UnitTester::AllocationHook::install();
+}
+
+void* operator new(std::size_t size) {
+  return UnitTester::AllocationHook::allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return UnitTester::AllocationHook::allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept {
+  UnitTester::AllocationHook::deallocate(p, alignof(std::max_align_t));
+}
+
+void operator delete(void* p, std::align_val_t alignment) noexcept {
+  UnitTester::AllocationHook::deallocate(p, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+  UnitTester::AllocationHook::deallocate(p, alignof(std::max_align_t));
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept {
+  UnitTester::AllocationHook::deallocate(p, static_cast<std::size_t>(alignment));
+}
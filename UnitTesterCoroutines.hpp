@@ -0,0 +1,100 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://www.mozilla.org/en-US/MPL/2.0/.
+ * Copyright © 2020 Yann Quelen */
+
+
+// Coroutine support for UnitTester. Requires C++20.
+//
+// With this header, the callables given to expect_true(), expect_false(),
+// expect_value() and expect_in_range() can return awaitables, such as the
+// tasks of coroutine libraries, as well as std::future. Each awaitable is
+// awaited by a small coroutine started with the test, which runs until the
+// awaitable first suspends, then completes on whatever thread resumes it, and
+// sets a std::future that UnitTester waits for with the other asynchronous
+// tests. So many tests waiting on input or output take about the time of the
+// slowest one.
+//
+// The awaitables must be resumed by something else than the thread waiting in
+// wait_async(), typically the threads of an event loop or of a thread pool.
+// A test timing out leaves its coroutine suspended, and it is never destroyed.
+//
+// Usage:
+//     UnitTester test;
+//
+//     test("fetch").expect_value(200, [&] { return client.get_status("/"); });
+//     test.wait_async();
+
+#pragma once
+
+#include "UnitTester.hpp"
+#include <coroutine>
+#include <exception>
+#include <future>
+
+class UnitTester::AwaitableHook
+{
+  private:
+    // The coroutine awaiting an awaitable. It starts immediately, and its frame
+    // is destroyed when it completes.
+    struct driver {
+      struct promise_type {
+        driver get_return_object() noexcept { return driver(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept { }
+        void unhandled_exception() noexcept { std::terminate(); }
+      };
+    };
+
+    template <typename Result, typename Awaitable>
+    static driver drive_(Awaitable awaitable, std::promise<Result> promise) {
+      try {
+        if constexpr (std::is_void_v<Result>) {
+          co_await std::move(awaitable);
+          promise.set_value();
+        } else {
+          promise.set_value(co_await std::move(awaitable));
+        }
+      } catch (...) {
+        promise.set_exception(std::current_exception());
+      }
+    }
+
+    // The awaiter a co_await expression would use
+    template <typename Awaitable>
+    static decltype(auto) awaiter_(Awaitable&& a) {
+      if constexpr (requires { static_cast<Awaitable&&>(a).operator co_await(); }) {
+        return static_cast<Awaitable&&>(a).operator co_await();
+      } else if constexpr (requires { operator co_await(static_cast<Awaitable&&>(a)); }) {
+        return operator co_await(static_cast<Awaitable&&>(a));
+      } else {
+        return static_cast<Awaitable&&>(a);
+      }
+    }
+
+  public:
+    template <typename Awaitable>
+    static constexpr bool is_awaitable = requires (Awaitable a) {
+      awaiter_(std::move(a)).await_ready();
+      awaiter_(std::move(a)).await_resume();
+    };
+
+    template <typename Awaitable>
+    using result = std::decay_t<decltype(awaiter_(std::declval<Awaitable>()).await_resume())>;
+
+    /** Starts awaiting an awaitable, and returns the future of its result. */
+    template <typename Awaitable>
+    static std::future<result<Awaitable>> start(Awaitable awaitable) {
+      std::promise<result<Awaitable>> promise;
+      std::future<result<Awaitable>> future = promise.get_future();
+      drive_<result<Awaitable>>(std::move(awaitable), std::move(promise));
+      return future;
+    }
+};
+
+template <typename Awaitable>
+struct UnitTester::AsyncResult<Awaitable, std::enable_if_t<UnitTester::AwaitableHook::is_awaitable<Awaitable>>> {
+  static constexpr bool is_async = true;
+  static auto start(Awaitable awaitable) { return AwaitableHook::start(std::move(awaitable)); }
+};
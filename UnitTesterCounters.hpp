@@ -0,0 +1,143 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://www.mozilla.org/en-US/MPL/2.0/.
+ * Copyright © 2020 Yann Quelen */
+
+
+// Hardware performance counters for UnitTester, on Linux only.
+//
+// Each thread opens a group of perf_event_open() counters on its first read:
+// instructions, cycles, cache misses and branch misses, counted in user space
+// only, which unprivileged processes are usually allowed to do. The counters
+// run from then on, and a read returns the totals of the whole group at once,
+// so measures can be nested. Reading costs one system call.
+//
+// This header also reads the resident set size of the process in
+// /proc/self/statm, reported by expect_peak_memory_below(), and the CPU time
+// of the calling thread with CLOCK_THREAD_CPUTIME_ID, recorded for each test
+// by timing().
+//
+// Without this header, on other systems, or when the system refuses to open
+// the counters, UnitTester runs the tests without counting anything.
+// This header can be included in any number of source files.
+
+#pragma once
+
+#include "UnitTester.hpp"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#include <cstring>
+#include <cstdio>
+
+class UnitTester::CounterHook
+{
+  private:
+    static constexpr int n_events = 4;
+
+    // The counters of one thread. The first one leads the group.
+    struct group {
+      int fds[n_events];
+      uint64_t ids[n_events];
+      pid_t pid;
+      bool opened;
+
+      group() : fds { -1, -1, -1, -1 }, ids { }, pid(0), opened(false) { }
+      ~group() { close_(); }
+      group(group const&) = delete;
+      group& operator=(group const&) = delete;
+
+      void close_() {
+        for (int& fd : fds) {
+          if (fd >= 0) close(fd);
+          fd = -1;
+        }
+        opened = false;
+      }
+    };
+
+    static int open_event_(uint64_t config, int group_fd) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+      return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    // Opens the counters of the calling thread. Only the first one is required,
+    // the processor may not be able to count the others.
+    static void open_(group& g) {
+      g.close_();
+      g.opened = true;
+      g.pid = getpid();
+      static constexpr uint64_t events[n_events] = {
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+      };
+      for (int k = 0; k < n_events; ++k) {
+        g.fds[k] = open_event_(events[k], g.fds[0]);
+        if (g.fds[k] >= 0 && ioctl(g.fds[k], PERF_EVENT_IOC_ID, &g.ids[k]) != 0) {
+          close(g.fds[k]);
+          g.fds[k] = -1;
+        }
+        if (g.fds[0] < 0) return;
+      }
+    }
+
+    static bool read_(counter_values& values) {
+      static thread_local group g;
+      // After a fork, the inherited counters still count the parent
+      if (!g.opened || g.pid != getpid()) open_(g);
+      if (g.fds[0] < 0) return false;
+      struct {
+        uint64_t nr;
+        struct { uint64_t value; uint64_t id; } counts[n_events];
+      } data;
+      if (read(g.fds[0], &data, sizeof(data)) <= 0) return false;
+      uint64_t* fields[n_events] = { &values.instructions, &values.cycles, &values.cache_misses, &values.branch_misses };
+      for (int k = 0; k < n_events; ++k) {
+        *fields[k] = 0;
+        for (uint64_t i = 0; i < data.nr && i < n_events; ++i) {
+          if (g.fds[k] >= 0 && data.counts[i].id == g.ids[k]) *fields[k] = data.counts[i].value;
+        }
+      }
+      return true;
+    }
+
+    static bool read_rss_(uint64_t& bytes) {
+      std::FILE* statm = std::fopen("/proc/self/statm", "r");
+      if (!statm) return false;
+      unsigned long long size = 0;
+      unsigned long long resident = 0;
+      bool parsed = std::fscanf(statm, "%llu %llu", &size, &resident) == 2;
+      std::fclose(statm);
+      if (!parsed) return false;
+      bytes = resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+      return true;
+    }
+
+    static bool read_thread_cpu_(std::chrono::nanoseconds& time) {
+      timespec t;
+      if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) != 0) return false;
+      time = std::chrono::seconds(t.tv_sec) + std::chrono::nanoseconds(t.tv_nsec);
+      return true;
+    }
+
+  public:
+    // Tells UnitTester how to read the counters. Called once at startup.
+    static bool install() {
+      counter_reader_ = &read_;
+      rss_reader_ = &read_rss_;
+      thread_cpu_reader_ = &read_thread_cpu_;
+      return true;
+    }
+};
+
+namespace {
+  bool const unit_tester_counter_hook = UnitTester::CounterHook::install();
+}
@@ -0,0 +1,388 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://www.mozilla.org/en-US/MPL/2.0/.
+ * Copyright © 2020 Yann Quelen */
+
+
+// Process isolation for UnitTester, on POSIX systems only.
+//
+// run_isolated() forks a pool of worker processes once the tests are queued,
+// so the workers inherit the queue. Each worker reads the index of a test on a
+// pipe, runs it, writes its result in its slot of shared memory, and writes
+// one byte on another pipe when done. When a worker dies, this pipe is closed,
+// which the parent notices and reports as a failure of the test the worker was
+// running, before starting a new worker. The parent also kills the workers
+// running a test over its time limit, which is reported the same way.
+
+#pragma once
+
+#include "UnitTester.hpp"
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+class UnitTester::isolated_pool
+{
+  private:
+    static constexpr std::size_t message_capacity = 64 * 1024;
+
+    // Result of a test, written by a worker in shared memory
+    struct slot {
+      uint32_t passed;
+      Status status;
+      uint32_t message_size;
+      int64_t duration_ns;
+      int64_t cpu_ns;
+      uint32_t cpu_timed;
+      uint64_t alloc_count;
+      uint64_t alloc_bytes;
+      uint64_t alloc_peak;
+      uint32_t counted;
+      counter_values counters;
+      char message[message_capacity];
+    };
+
+    struct worker {
+      pid_t pid;
+      int command_fd;
+      int result_fd;
+      std::size_t test;
+      bool busy;
+      std::chrono::steady_clock::time_point started;
+    };
+
+    UnitTester& tester_;
+    std::vector<queued_test>& tests_;
+    std::vector<worker> workers_;
+    slot* slots_;
+    bool all_passed_;
+    // errno of the last failure to start a worker
+    int spawn_error_;
+
+    static bool read_all_(int fd, void* data, std::size_t size) {
+      char* p = static_cast<char*>(data);
+      while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= static_cast<std::size_t>(n);
+      }
+      return true;
+    }
+
+    // The loop of a worker process, which never returns
+    [[noreturn]] void work_(std::size_t w, int command_fd, int result_fd) {
+      slot& s = slots_[w];
+      result_buffer buffer(tester_, 4);
+      uint64_t index;
+      while (read_all_(command_fd, &index, sizeof(index))) {
+        queued_test& test = tests_[index];
+        s.passed = (*test.check)(buffer, test.id.get());
+        // A hidden pass has no record
+        s.status = s.passed ? Status::pass : Status::fail;
+        s.message_size = 0;
+        s.duration_ns = 0;
+        s.cpu_ns = 0;
+        s.cpu_timed = 0;
+        s.alloc_count = 0;
+        s.alloc_bytes = 0;
+        s.alloc_peak = 0;
+        s.counted = 0;
+        buffer.take([&s](TestRecord const& r, std::string_view message) {
+          std::size_t n = std::min<std::size_t>(message.size(), message_capacity - s.message_size);
+          std::memcpy(s.message + s.message_size, message.data(), n);
+          s.message_size += static_cast<uint32_t>(n);
+          s.duration_ns = r.duration_ns;
+          s.status = r.status;
+        });
+        // The record of a hidden pass is dropped with its duration
+        if (tester_.timing_ && !tester_.timings_.empty()) {
+          s.duration_ns = tester_.timings_.back().wall_time.count();
+          if (tester_.timings_.back().cpu_time) {
+            s.cpu_timed = 1;
+            s.cpu_ns = tester_.timings_.back().cpu_time->count();
+          }
+          tester_.timings_.clear();
+        }
+        if (tester_.track_allocations_ && !tester_.allocations_.empty()) {
+          s.alloc_count = tester_.allocations_.back().count;
+          s.alloc_bytes = tester_.allocations_.back().bytes;
+          s.alloc_peak = tester_.allocations_.back().peak_bytes;
+          tester_.allocations_.clear();
+        }
+        if (tester_.hardware_counters_ && !tester_.counters_.empty()) {
+          TestCounters const& c = tester_.counters_.back();
+          s.counted = 1;
+          s.counters = counter_values { c.instructions, c.cycles, c.cache_misses, c.branch_misses };
+          tester_.counters_.clear();
+        }
+        // What the test itself printed would be lost by _exit()
+        std::cout.flush();
+        std::cerr.flush();
+        std::fflush(nullptr);
+        char done = 1;
+        if (write(result_fd, &done, 1) != 1) break;
+      }
+      // Skips the destructors and atexit handlers, which belong to the parent
+      _exit(0);
+    }
+
+    // Starts worker w. Returns false if the system refused, with its errno in
+    // spawn_error_.
+    bool spawn_(std::size_t w) {
+      int command[2];
+      int result[2];
+      if (pipe(command) != 0) {
+        spawn_error_ = errno;
+        return false;
+      }
+      if (pipe(result) != 0) {
+        spawn_error_ = errno;
+        close(command[0]);
+        close(command[1]);
+        return false;
+      }
+      // The worker inherits the buffers of the reporter and of the standard
+      // streams, and would print again the results they still hold
+      tester_.flush();
+      std::cout.flush();
+      std::cerr.flush();
+      std::fflush(nullptr);
+      // The watchdog must not hold its mutex during the fork, or the worker,
+      // which has no watchdog, would inherit it locked forever and block on it
+      // in its first limited test
+      std::unique_lock<std::mutex> watch_lock(tester_.watch_mutex_);
+      pid_t pid = fork();
+      watch_lock.unlock();
+      if (pid < 0) {
+        spawn_error_ = errno;
+        close(command[0]);
+        close(command[1]);
+        close(result[0]);
+        close(result[1]);
+        return false;
+      }
+      if (pid == 0) {
+        // The pipes of the other workers must be closed, or their death would
+        // not close them
+        for (worker& other : workers_) {
+          if (other.pid > 0) {
+            close(other.command_fd);
+            close(other.result_fd);
+          }
+        }
+        close(command[1]);
+        close(result[0]);
+        work_(w, command[0], result[1]);
+      }
+      close(command[0]);
+      close(result[1]);
+      workers_[w] = worker { pid, command[1], result[0], 0, false, {} };
+      return true;
+    }
+
+    // Waits for the end of worker w, and returns its status
+    int reap_(std::size_t w) {
+      worker& dead = workers_[w];
+      close(dead.command_fd);
+      close(dead.result_fd);
+      int status = 0;
+      while (waitpid(dead.pid, &status, 0) < 0 && errno == EINTR) { }
+      dead.pid = -1;
+      dead.busy = false;
+      return status;
+    }
+
+    // Records the result of the test worker w has completed
+    void report_(std::size_t w) {
+      slot const& s = slots_[w];
+      test_id id = tests_[workers_[w].test].id.get();
+      result_buffer& out = tester_.main_buffer_;
+      if (tester_.timing_) {
+        std::lock_guard<std::mutex> lock(tester_.timings_mutex_);
+        std::optional<std::chrono::nanoseconds> cpu;
+        if (s.cpu_timed) cpu = std::chrono::nanoseconds(s.cpu_ns);
+        tester_.timings_.push_back(TestTiming { std::string(id.text), std::chrono::nanoseconds(s.duration_ns), cpu });
+      }
+      if (tester_.track_allocations_) {
+        std::lock_guard<std::mutex> lock(tester_.allocations_mutex_);
+        tester_.allocations_.push_back(TestAllocations { std::string(id.text), s.alloc_count, s.alloc_bytes,
+                                                           s.alloc_peak });
+      }
+      if (s.counted) {
+        std::lock_guard<std::mutex> lock(tester_.counters_mutex_);
+        tester_.counters_.push_back(TestCounters { std::string(id.text), s.counters.instructions, s.counters.cycles,
+                                                   s.counters.cache_misses, s.counters.branch_misses });
+      }
+      out.duration(s.duration_ns);
+      std::ostream& os = s.status == Status::skip ? tester_.skipped_(out, id)
+                       : s.passed ? tester_.pass_(out, id) : tester_.fail_(out, id);
+      os.write(s.message, s.message_size);
+      if (s.message_size == message_capacity) os << "\n  (message truncated)\n";
+      if (!s.passed) all_passed_ = false;
+    }
+
+    // Records the failure of the test worker w was running when it died
+    void report_death_(std::size_t w, int status) {
+      test_id id = tests_[workers_[w].test].id.get();
+      std::ostream& os = tester_.fail_(tester_.main_buffer_, id);
+      if (WIFSIGNALED(status)) {
+        os << "  worker process killed by signal " << WTERMSIG(status) << " (" << strsignal(WTERMSIG(status)) << ")\n";
+      } else {
+        os << "  worker process exited with status " << WEXITSTATUS(status) << '\n';
+      }
+      all_passed_ = false;
+    }
+
+    // Records the failure of the test worker w was running when it was killed
+    // for missing its deadline
+    void report_timeout_(std::size_t w, std::chrono::steady_clock::duration elapsed) {
+      tester_.fail_(tester_.main_buffer_, tests_[workers_[w].test].id.get())
+        << "  timed out after " << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+        << " ms, worker process killed\n";
+      all_passed_ = false;
+    }
+
+    // Returns the time left, in milliseconds, before the first deadline of the
+    // running tests, or -1 if they have no time limit
+    int poll_timeout_() const {
+      auto now = std::chrono::steady_clock::now();
+      int timeout = -1;
+      for (worker const& w : workers_) {
+        std::chrono::nanoseconds limit = tests_[w.test].timeout;
+        if (!w.busy || limit.count() <= 0) continue;
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(w.started + limit - now).count();
+        int ms = static_cast<int>(std::clamp<decltype(left)>(left, 0, std::numeric_limits<int>::max()));
+        timeout = (timeout < 0) ? ms : std::min(timeout, ms);
+      }
+      return timeout;
+    }
+
+    // Kills the workers running a test past its deadline. Returns how many.
+    std::size_t kill_overdue_() {
+      auto now = std::chrono::steady_clock::now();
+      std::size_t killed = 0;
+      for (std::size_t w = 0; w < workers_.size(); ++w) {
+        std::chrono::nanoseconds limit = tests_[workers_[w].test].timeout;
+        if (!workers_[w].busy || limit.count() <= 0 || now < workers_[w].started + limit) continue;
+        kill(workers_[w].pid, SIGKILL);
+        std::size_t test = workers_[w].test;
+        reap_(w);
+        workers_[w].test = test;
+        report_timeout_(w, now - workers_[w].started);
+        ++killed;
+      }
+      return killed;
+    }
+
+    // Records the failure of tests which could not be run at all
+    void report_unrun_(std::size_t first, std::size_t last, int error) {
+      for (std::size_t i = first; i < last; ++i) {
+        tester_.fail_(tester_.main_buffer_, tests_[i].id.get())
+          << "  could not start a worker process: " << std::strerror(error) << '\n';
+      }
+      all_passed_ = false;
+    }
+
+  public:
+    isolated_pool(UnitTester& tester, std::vector<queued_test>& tests)
+    : tester_(tester), tests_(tests), workers_(), slots_(nullptr), all_passed_(true), spawn_error_(0)
+    { }
+
+    bool run(unsigned jobs) {
+      std::size_t n = tests_.size();
+      if (n == 0) return true;
+      std::size_t n_workers = std::min<std::size_t>(jobs > 0 ? jobs : 1, n);
+      void* shared = mmap(nullptr, n_workers * sizeof(slot), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if (shared == MAP_FAILED) {
+        int error = errno;
+        report_unrun_(0, n, error);
+        return false;
+      }
+      slots_ = static_cast<slot*>(shared);
+      // A worker dying between two tests must not kill the parent when it is
+      // given the next one
+      auto previous_sigpipe = std::signal(SIGPIPE, SIG_IGN);
+      workers_.assign(n_workers, worker { -1, -1, -1, 0, false, {} });
+      std::size_t next = 0;
+      std::size_t done = 0;
+      std::vector<pollfd> fds;
+      std::vector<std::size_t> polled;
+      while (done < n) {
+        bool any_alive = false;
+        if (tester_.fail_fast_reached_() && next < n) {
+          tester_.count_skip_ += n - next;
+          done += n - next;
+          next = n;
+        }
+        for (std::size_t w = 0; w < n_workers; ++w) {
+          if (workers_[w].pid < 0 && next < n && !spawn_(w)) continue;
+          if (workers_[w].pid < 0) continue;
+          any_alive = true;
+          if (workers_[w].busy || next == n) continue;
+          uint64_t index = next;
+          if (write(workers_[w].command_fd, &index, sizeof(index)) != sizeof(index)) {
+            reap_(w);
+            continue;
+          }
+          workers_[w].test = next++;
+          workers_[w].busy = true;
+          workers_[w].started = std::chrono::steady_clock::now();
+        }
+        if (!any_alive) {
+          report_unrun_(next, n, spawn_error_);
+          break;
+        }
+        fds.clear();
+        polled.clear();
+        for (std::size_t w = 0; w < n_workers; ++w) {
+          if (workers_[w].busy) {
+            fds.push_back(pollfd { workers_[w].result_fd, POLLIN, 0 });
+            polled.push_back(w);
+          }
+        }
+        if (fds.empty()) continue;
+        if (poll(fds.data(), static_cast<nfds_t>(fds.size()), poll_timeout_()) < 0) continue;
+        for (std::size_t k = 0; k < fds.size(); ++k) {
+          if (fds[k].revents == 0) continue;
+          std::size_t w = polled[k];
+          char ack;
+          if (read_all_(workers_[w].result_fd, &ack, 1)) {
+            report_(w);
+            workers_[w].busy = false;
+          } else {
+            std::size_t test = workers_[w].test;
+            int status = reap_(w);
+            workers_[w].test = test;
+            report_death_(w, status);
+          }
+          ++done;
+        }
+        done += kill_overdue_();
+        tester_.main_buffer_.completed();
+      }
+      for (std::size_t w = 0; w < n_workers; ++w) {
+        if (workers_[w].pid > 0) reap_(w);
+      }
+      std::signal(SIGPIPE, previous_sigpipe);
+      munmap(shared, n_workers * sizeof(slot));
+      return all_passed_;
+    }
+};
+
+inline bool UnitTester::run_isolated(unsigned jobs) {
+  std::vector<queued_test> tests;
+  tests.swap(queue_);
+  order_queue_(tests);
+  isolated_pool pool(*this, tests);
+  bool all_passed = pool.run(jobs);
+  flush();
+  return all_passed;
+}
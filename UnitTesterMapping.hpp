@@ -0,0 +1,65 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://www.mozilla.org/en-US/MPL/2.0/.
+ * Copyright © 2020 Yann Quelen */
+
+
+// Memory mapping of golden files for UnitTester, on POSIX systems.
+//
+// With this header, expect_matches_golden() maps each golden file read-only
+// and compares the output of its producer directly with the mapped pages,
+// which the system is told are read sequentially. Nothing of the file is
+// copied, and memcmp() of the C library compares with vector instructions.
+// Without it, or when a file cannot be mapped, the golden file is read in
+// chunks through a std::ifstream.
+// This header can be included in any number of source files.
+
+#pragma once
+
+#include "UnitTester.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+class UnitTester::MappingHook
+{
+  private:
+    static void unmap_(char const* data, uint64_t size) {
+      munmap(const_cast<char*>(data), static_cast<std::size_t>(size));
+    }
+
+    static bool map_(std::string const& path, mapped_file& file) {
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) return false;
+      struct stat status;
+      if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+        close(fd);
+        return false;
+      }
+      std::size_t size = static_cast<std::size_t>(status.st_size);
+      // An empty file cannot be mapped, and has nothing to compare
+      if (size == 0) {
+        close(fd);
+        file = mapped_file { nullptr, 0, nullptr };
+        return true;
+      }
+      void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (data == MAP_FAILED) return false;
+      madvise(data, size, MADV_SEQUENTIAL);
+      file = mapped_file { static_cast<char const*>(data), size, &unmap_ };
+      return true;
+    }
+
+  public:
+    // Tells UnitTester how to map golden files. Called once at startup.
+    static bool install() {
+      file_mapper_ = &map_;
+      return true;
+    }
+};
+
+namespace {
+  bool const unit_tester_mapping_hook = UnitTester::MappingHook::install();
+}
@@ -0,0 +1,269 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://www.mozilla.org/en-US/MPL/2.0/.
+ * Copyright © 2020 Yann Quelen */
+
+
+// Sampling profiler for UnitTester, on POSIX systems.
+//
+// While the callable of a test selected by profile() runs, an ITIMER_PROF
+// timer sends SIGPROF every interval of CPU time of the process, and the
+// handler records the stack of the thread running the test, if the signal
+// interrupted it. The handler only reads memory, which is async-signal-safe:
+// it follows the chain of frame pointers from the registers of the
+// interrupted code, within the stack of the thread and below the caller of the
+// callable, and writes the addresses in a ring of samples. The ring is sized
+// from the interval and the expected duration of the test, its duration in
+// the previous run of the results cache, else its time limit, else 1 s, and
+// allocated before the callable runs. When the test runs longer, the oldest
+// samples are overwritten and counted as [lost]. The addresses are aggregated
+// and named with dladdr() when the callable returns.
+//
+// Complete stacks need frame pointers, so the tests should be compiled with
+// -fno-omit-frame-pointer. Frames are followed on Linux and macOS, on x86-64
+// and AArch64. Elsewhere, only the interrupted function is recorded.
+// Functions of the executable are only named if they are exported, for
+// instance when linking with -rdynamic, else they are given as their module
+// and offset.
+//
+// The handler of SIGPROF is installed by the first profiled test, and the
+// timer runs only while profiled tests run, so other profilers can be used
+// when no test is profiled.
+// This header can be included in any number of source files.
+//
+// Usage:
+//     UnitTester test;
+//     test.profile("parser *");
+//     ...
+//     test.save_profiles("tests.folded");
+//
+// then for instance: flamegraph.pl tests.folded > tests.svg
+
+#pragma once
+
+#include "UnitTester.hpp"
+#include <csignal>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/ucontext.h>
+
+class UnitTester::ProfilerHook
+{
+  private:
+    static constexpr int max_depth = 64;
+    static constexpr std::size_t min_slots = 64;
+    static constexpr std::size_t max_slots = 8192;
+
+    // The ring of samples of the calling thread: for each slot, its depth, and
+    // its addresses from the innermost in a row of max_depth
+    struct samples {
+      std::vector<uintptr_t> frames;
+      std::vector<int> depths;
+      std::size_t slots;
+      // Samples recorded since the start, in slot count % slots
+      uint64_t count;
+      // The bounds of the stack the handler reads, 0 if unknown
+      uintptr_t stack_low;
+      uintptr_t base;
+
+      samples() : frames(), depths(), slots(0), count(0), stack_low(stack_low_()), base(0) { }
+    };
+
+    static samples& thread_samples_() {
+      static thread_local samples s;
+      return s;
+    }
+
+    // The samples the handler records to, null when the thread is not profiled
+    static inline thread_local samples* volatile active_ = nullptr;
+    static inline std::mutex timer_mutex_;
+    static inline unsigned profiled_threads_ = 0;
+    static inline bool handler_installed_ = false;
+
+    // Returns the lowest address of the stack of the calling thread, or 0 if
+    // it is unknown
+    static uintptr_t stack_low_() {
+#if defined(__linux__)
+      pthread_attr_t attr;
+      if (pthread_getattr_np(pthread_self(), &attr) != 0) return 0;
+      void* low = nullptr;
+      std::size_t size = 0;
+      int error = pthread_attr_getstack(&attr, &low, &size);
+      pthread_attr_destroy(&attr);
+      return error == 0 ? reinterpret_cast<uintptr_t>(low) : 0;
+#elif defined(__APPLE__)
+      pthread_t self = pthread_self();
+      return reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(self)) - pthread_get_stacksize_np(self);
+#else
+      return 0;
+#endif
+    }
+
+    // Reads the program counter, the frame pointer and the stack pointer of
+    // the interrupted code. Returns false if this is not supported.
+    static bool registers_(void const* context, uintptr_t& pc, uintptr_t& fp, uintptr_t& sp) {
+      ucontext_t const* uc = static_cast<ucontext_t const*>(context);
+#if defined(__linux__) && defined(__x86_64__)
+      pc = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]);
+      fp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RBP]);
+      sp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RSP]);
+#elif defined(__linux__) && defined(__aarch64__)
+      pc = static_cast<uintptr_t>(uc->uc_mcontext.pc);
+      fp = static_cast<uintptr_t>(uc->uc_mcontext.regs[29]);
+      sp = static_cast<uintptr_t>(uc->uc_mcontext.sp);
+#elif defined(__APPLE__) && defined(__x86_64__)
+      pc = static_cast<uintptr_t>(uc->uc_mcontext->__ss.__rip);
+      fp = static_cast<uintptr_t>(uc->uc_mcontext->__ss.__rbp);
+      sp = static_cast<uintptr_t>(uc->uc_mcontext->__ss.__rsp);
+#elif defined(__APPLE__) && defined(__aarch64__)
+      pc = static_cast<uintptr_t>(__darwin_arm_thread_state64_get_pc(uc->uc_mcontext->__ss));
+      fp = static_cast<uintptr_t>(__darwin_arm_thread_state64_get_fp(uc->uc_mcontext->__ss));
+      sp = static_cast<uintptr_t>(__darwin_arm_thread_state64_get_sp(uc->uc_mcontext->__ss));
+#else
+      (void)uc;
+      (void)pc;
+      (void)fp;
+      (void)sp;
+      return false;
+#endif
+      return true;
+    }
+
+    static void on_signal_(int, siginfo_t*, void* context) {
+      samples* s = active_;
+      if (!s) return;
+      std::size_t slot = static_cast<std::size_t>(s->count % s->slots);
+      uintptr_t* frames = s->frames.data() + slot * max_depth;
+      int depth = 0;
+      uintptr_t pc, fp, sp;
+      if (registers_(context, pc, fp, sp)) {
+        // The program counter is stored plus one, like a return address
+        frames[depth++] = pc + 1;
+        // Each frame record holds the frame pointer of the caller, then the
+        // return address. Records are only read within the stack, and stop
+        // at the caller of the callable or at a pointer not going up.
+        if (s->stack_low != 0 && sp >= s->stack_low && sp < s->base) {
+          while (depth < max_depth && fp >= sp && fp % alignof(uintptr_t) == 0
+                 && fp + 2 * sizeof(uintptr_t) <= s->base) {
+            uintptr_t const* record = reinterpret_cast<uintptr_t const*>(fp);
+            frames[depth++] = record[1];
+            if (record[0] <= fp) break;
+            fp = record[0];
+          }
+        }
+      }
+      s->depths[slot] = depth;
+      ++s->count;
+    }
+
+    static void set_timer_(std::chrono::nanoseconds interval) {
+      itimerval timer;
+      timer.it_interval.tv_sec = static_cast<time_t>(interval.count() / 1000000000);
+      timer.it_interval.tv_usec = static_cast<suseconds_t>(interval.count() % 1000000000 / 1000);
+      // An interval of 0 would stop the timer
+      if (interval.count() > 0 && interval < std::chrono::microseconds(1)) timer.it_interval.tv_usec = 1;
+      timer.it_value = timer.it_interval;
+      setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+
+    static bool start_(std::chrono::nanoseconds interval, std::chrono::nanoseconds duration, void const* base) {
+      // Twice the expected samples, as the test may be slower this time
+      std::size_t slots = static_cast<std::size_t>(
+        std::clamp<int64_t>(duration / interval * 2, min_slots, max_slots));
+      samples& s = thread_samples_();
+      s.frames.resize(slots * max_depth);
+      s.depths.resize(slots);
+      s.slots = slots;
+      s.count = 0;
+      s.base = reinterpret_cast<uintptr_t>(base);
+      // The handler, running on this thread, must see the ring ready
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      // Tests running on several threads share the timer of the process
+      std::lock_guard<std::mutex> lock(timer_mutex_);
+      if (!handler_installed_) {
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_sigaction = &on_signal_;
+        action.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, nullptr) != 0) return false;
+        handler_installed_ = true;
+      }
+      active_ = &s;
+      if (profiled_threads_++ == 0) set_timer_(interval);
+      return true;
+    }
+
+    // Returns the name of the function holding a return address
+    static std::string name_(uintptr_t address) {
+      // The return address may be the first instruction of the next function
+      void* call = reinterpret_cast<void*>(address - 1);
+      Dl_info info;
+      std::string name;
+      if (dladdr(call, &info) && info.dli_sname) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        name = (status == 0 && demangled) ? demangled : info.dli_sname;
+        std::free(demangled);
+      } else if (dladdr(call, &info) && info.dli_fname) {
+        std::string_view module(info.dli_fname);
+        module.remove_prefix(std::min(module.rfind('/') + 1, module.size()));
+        std::ostringstream os;
+        os << module << "+0x" << std::hex
+           << (reinterpret_cast<uintptr_t>(call) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+        name = os.str();
+      } else {
+        std::ostringstream os;
+        os << "0x" << std::hex << reinterpret_cast<uintptr_t>(call);
+        name = os.str();
+      }
+      std::replace(name.begin(), name.end(), ';', ':');
+      return name;
+    }
+
+    static void stop_(callable_ref<void(std::string_view, uint64_t)> add) {
+      samples& s = thread_samples_();
+      {
+        std::lock_guard<std::mutex> lock(timer_mutex_);
+        if (--profiled_threads_ == 0) set_timer_(std::chrono::nanoseconds(0));
+        active_ = nullptr;
+      }
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      std::unordered_map<uintptr_t, std::string> names;
+      std::unordered_map<std::string, uint64_t> stacks;
+      std::string stack;
+      std::size_t kept = static_cast<std::size_t>(std::min<uint64_t>(s.count, s.slots));
+      if (s.count > kept) stacks["[lost]"] = s.count - kept;
+      for (std::size_t i = 0; i < kept; ++i) {
+        uintptr_t const* frames = s.frames.data() + i * max_depth;
+        int depth = s.depths[i];
+        stack.clear();
+        for (int f = depth - 1; f >= 0; --f) {
+          auto found = names.find(frames[f]);
+          if (found == names.end()) found = names.emplace(frames[f], name_(frames[f])).first;
+          if (!stack.empty()) stack += ';';
+          stack += found->second;
+        }
+        if (stack.empty()) stack = "[unknown]";
+        ++stacks[stack];
+      }
+      for (auto const& sampled : stacks) add(sampled.first, sampled.second);
+    }
+
+  public:
+    // Tells UnitTester how to sample stacks. Called once at startup.
+    static bool install() {
+      profiler_start_ = &start_;
+      profiler_stop_ = &stop_;
+      return true;
+    }
+};
+
+namespace {
+  bool const unit_tester_profiler_hook = UnitTester::ProfilerHook::install();
+}
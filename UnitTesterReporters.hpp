@@ -0,0 +1,267 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://www.mozilla.org/en-US/MPL/2.0/.
+ * Copyright © 2020 Yann Quelen */
+
+
+// Machine readable reporters for UnitTester.
+//
+// Each reporter formats a batch of results in a string reused across batches,
+// writes it and flushes the stream, so the memory used does not depend on the
+// number of tests, and everything reported survives if the process dies.
+// Results still buffered by a UnitTester with batch_size() are lost then,
+// and run_isolated() survives crashing tests.
+// Durations are 0 unless timing is enabled in the UnitTester.
+//
+// Usage:
+//     std::ofstream file("results.xml");
+//     UnitTester::JUnitReporter junit(file);
+//     UnitTester test;
+//     test.reporter(junit);
+//
+// The reporter must outlive the UnitTester, so it must be declared first.
+
+#pragma once
+
+#include "UnitTester.hpp"
+#include <cstdio>
+
+class UnitTester::report_text
+{
+  public:
+    static char const* status_name(Status status) {
+      switch (status) {
+        case Status::pass: return "pass";
+        case Status::fail: return "fail";
+        case Status::benchmark: return "benchmark";
+        case Status::skip: return "skip";
+      }
+      return "";
+    }
+
+    // Calls f(line) on each line of a message, without the indent added by the
+    // tests and without the line break
+    template <typename F>
+    static void for_each_line(std::string_view message, F f) {
+      while (!message.empty()) {
+        std::size_t end = std::min(message.find('\n'), message.size());
+        std::string_view line = message.substr(0, end);
+        if (line.substr(0, 2) == "  ") line.remove_prefix(2);
+        f(line);
+        message.remove_prefix(std::min(end + 1, message.size()));
+      }
+    }
+
+    static void append_json(std::string& out, std::string_view s) {
+      for (char c : s) {
+        switch (c) {
+          case '"': out += "\\\""; break;
+          case '\\': out += "\\\\"; break;
+          case '\n': out += "\\n"; break;
+          case '\r': out += "\\r"; break;
+          case '\t': out += "\\t"; break;
+          default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+              char code[8];
+              std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(c));
+              out += code;
+            } else {
+              out += c;
+            }
+        }
+      }
+    }
+
+    // Characters not allowed in XML 1.0 are replaced by '?'
+    static void append_xml(std::string& out, std::string_view s) {
+      for (char c : s) {
+        switch (c) {
+          case '&': out += "&amp;"; break;
+          case '<': out += "&lt;"; break;
+          case '>': out += "&gt;"; break;
+          case '"': out += "&quot;"; break;
+          case '\'': out += "&apos;"; break;
+          case '\n': case '\r': case '\t': out += c; break;
+          default: out += (static_cast<unsigned char>(c) < 0x20) ? '?' : c;
+        }
+      }
+    }
+
+    // Appends a duration in nanoseconds as a decimal number of the given unit
+    static void append_duration(std::string& out, int64_t ns, double unit_ns) {
+      char number[32];
+      std::snprintf(number, sizeof(number), "%.6f", static_cast<double>(ns) / unit_ns);
+      out += number;
+    }
+
+    static void write(std::ostream& out, std::string const& text) {
+      out.write(text.data(), static_cast<std::streamsize>(text.size()));
+      out.flush();
+    }
+};
+
+// Writes a JUnit XML document with one testcase element per result. The
+// closing tags are written by finish() or the destructor. Failure messages are
+// in failure elements, and other messages, such as the statistics of
+// benchmarks, in system-out elements.
+class UnitTester::JUnitReporter : public UnitTester::Reporter
+{
+  private:
+    std::ostream& out_;
+    std::string suite_;
+    std::string text_;
+    std::string body_;
+    bool finished_;
+
+  public:
+    JUnitReporter(std::ostream& out, std::string_view suite = "UnitTester")
+    : out_(out), suite_(), text_(), body_(), finished_(false)
+    {
+      report_text::append_xml(suite_, suite);
+      text_.append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n<testsuite name=\"")
+           .append(suite_).append("\">\n");
+      report_text::write(out_, text_);
+    }
+
+    ~JUnitReporter() override { finish(); }
+
+    void report(ResultBatch const& batch) override {
+      text_.clear();
+      for (TestRecord const& r : batch.records) {
+        text_.append("  <testcase classname=\"").append(suite_).append("\" name=\"");
+        report_text::append_xml(text_, batch.id(r));
+        text_.append("\" time=\"");
+        report_text::append_duration(text_, r.duration_ns, 1e9);
+        text_.append(1, '"');
+        std::string_view message = batch.message(r);
+        if (r.status != Status::fail && r.status != Status::skip && message.empty()) {
+          text_.append("/>\n");
+          continue;
+        }
+        std::string_view first_line;
+        body_.clear();
+        report_text::for_each_line(message, [&](std::string_view line) {
+          if (body_.empty()) first_line = line;
+          body_.append(line).append(1, '\n');
+        });
+        if (r.status == Status::fail) {
+          text_.append(">\n    <failure message=\"");
+          report_text::append_xml(text_, first_line);
+          text_.append("\">");
+          report_text::append_xml(text_, body_);
+          text_.append("</failure>\n  </testcase>\n");
+        } else if (r.status == Status::skip) {
+          text_.append(">\n    <skipped message=\"");
+          report_text::append_xml(text_, first_line);
+          text_.append("\"/>\n  </testcase>\n");
+        } else {
+          text_.append(">\n    <system-out>");
+          report_text::append_xml(text_, body_);
+          text_.append("</system-out>\n  </testcase>\n");
+        }
+      }
+      report_text::write(out_, text_);
+    }
+
+    void flush() override { out_.flush(); }
+
+    /** Write the end of the document. Results reported afterwards are ignored
+     * by XML parsers. */
+    void finish() {
+      if (finished_) return;
+      finished_ = true;
+      out_ << "</testsuite>\n</testsuites>\n";
+      out_.flush();
+    }
+};
+
+// Writes one JSON object per line and per result, with the members id, status
+// ("pass", "fail", "benchmark" or "skip"), duration_ns and message.
+class UnitTester::JsonLinesReporter : public UnitTester::Reporter
+{
+  private:
+    std::ostream& out_;
+    std::string text_;
+
+  public:
+    JsonLinesReporter(std::ostream& out) : out_(out), text_() { }
+
+    void report(ResultBatch const& batch) override {
+      text_.clear();
+      for (TestRecord const& r : batch.records) {
+        text_.append("{\"id\":\"");
+        report_text::append_json(text_, batch.id(r));
+        text_.append("\",\"status\":\"").append(report_text::status_name(r.status))
+             .append("\",\"duration_ns\":").append(std::to_string(r.duration_ns)).append(",\"message\":\"");
+        bool first = true;
+        report_text::for_each_line(batch.message(r), [&](std::string_view line) {
+          if (!first) text_.append("\\n");
+          report_text::append_json(text_, line);
+          first = false;
+        });
+        text_.append("\"}\n");
+      }
+      report_text::write(out_, text_);
+    }
+
+    void flush() override { out_.flush(); }
+};
+
+// Writes a TAP version 13 stream. Messages and durations are given in YAML
+// blocks after the test lines. The plan is written at the end, by finish() or
+// the destructor, since the number of tests is not known in advance.
+class UnitTester::TapReporter : public UnitTester::Reporter
+{
+  private:
+    std::ostream& out_;
+    std::string text_;
+    uintmax_t count_;
+    bool finished_;
+
+  public:
+    TapReporter(std::ostream& out) : out_(out), text_("TAP version 13\n"), count_(0), finished_(false) {
+      report_text::write(out_, text_);
+    }
+
+    ~TapReporter() override { finish(); }
+
+    void report(ResultBatch const& batch) override {
+      text_.clear();
+      for (TestRecord const& r : batch.records) {
+        text_.append(r.status == Status::fail ? "not ok " : "ok ").append(std::to_string(++count_)).append(" - ");
+        // '#' would start a directive, and a line break a new test line
+        for (char c : batch.id(r)) {
+          if (c == '#') text_.append("\\#");
+          else text_.append(1, (c == '\n' || c == '\r') ? ' ' : c);
+        }
+        if (r.status == Status::skip) text_.append(" # SKIP");
+        text_.append(1, '\n');
+        std::string_view message = batch.message(r);
+        if (message.empty() && r.duration_ns == 0) continue;
+        text_.append("  ---\n");
+        if (r.duration_ns != 0) {
+          text_.append("  duration_ms: ");
+          report_text::append_duration(text_, r.duration_ns, 1e6);
+          text_.append(1, '\n');
+        }
+        if (!message.empty()) {
+          text_.append("  message: |\n");
+          report_text::for_each_line(message, [this](std::string_view line) {
+            text_.append("    ").append(line).append(1, '\n');
+          });
+        }
+        text_.append("  ...\n");
+      }
+      report_text::write(out_, text_);
+    }
+
+    void flush() override { out_.flush(); }
+
+    /** Write the plan, giving the number of tests reported. */
+    void finish() {
+      if (finished_) return;
+      finished_ = true;
+      out_ << "1.." << count_ << '\n';
+      out_.flush();
+    }
+};
@@ -0,0 +1,130 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://www.mozilla.org/en-US/MPL/2.0/.
+ * Copyright © 2020 Yann Quelen */
+
+
+// Benchmarks of the overhead of UnitTester itself.
+//
+// SelfBenchmark::run() measures, with expect_no_regression() of the given
+// UnitTester, the cost of one call of the common expect_* methods on the pass
+// and fail paths, of a test skipped by only_matching(), of a condition given
+// to only_if(), of a test named with operator(), with interned ids, of queuing
+// and running deferred tests, and of the default reporter. The measured tests
+// run in UnitTesters of their own, writing to a stream discarding everything,
+// so only the framework is measured, not the terminal. The ids of the
+// benchmarks start with "UnitTester ".
+//
+// Only the run time overhead is measured. The compile time of programs
+// including UnitTester.hpp is not: this repository is only headers, without a
+// build system to time compilations. No baseline is provided either, since
+// the times depend on the machine: each run writes it for the next one.
+//
+// Usage, as the whole program measuring the overhead:
+//     #include "UnitTesterSelfBenchmark.hpp"
+//
+//     int main() {
+//       UnitTester bench;
+//       bench.load_baseline("unit_tester_overhead.csv");
+//       bool success = UnitTester::SelfBenchmark::run(bench);
+//       bench.save_baseline("unit_tester_overhead.csv");
+//       bench.summary();
+//       return success ? 0 : 1;
+//     }
+
+#pragma once
+
+#include "UnitTester.hpp"
+#include <stdexcept>
+
+class UnitTester::SelfBenchmark
+{
+  private:
+    static constexpr int batch_size = 1000;
+
+    // Stream buffer discarding everything
+    class null_buffer : public std::streambuf {
+      protected:
+        int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+        std::streamsize xsputn(char const*, std::streamsize n) override { return n; }
+    };
+
+    // A UnitTester writing nowhere, without colors, as the measured tests
+    struct silent {
+      null_buffer buffer;
+      std::ostream out;
+      UnitTester test;
+
+      silent() : buffer(), out(&buffer), test(out) { test.color_output(false); }
+    };
+
+    // Measures one call of check(test) in a silent UnitTester set up by setup(test)
+    template <typename Setup, typename Check>
+    static bool measure_(UnitTester& bench, std::string_view id, Setup setup, Check check) {
+      silent s;
+      setup(s.test);
+      return bench.expect_no_regression(id, [&s, &check] { return check(s.test); });
+    }
+
+  public:
+    /** Measure the overhead of UnitTester with the benchmarks of bench, which
+     * fail if slower than its baseline, if any.
+     * @param bench The UnitTester measuring the benchmarks and recording their results.
+     * @return true if no benchmark regressed. */
+    static bool run(UnitTester& bench) {
+      auto none = [](UnitTester&) { };
+      auto quiet = [](UnitTester& test) { test.hide_pass(); };
+      bool success = true;
+
+      success &= measure_(bench, "UnitTester expect_true pass", quiet, [](UnitTester& test) {
+        return test.expect_true("pass", [] { return true; });
+      });
+      success &= measure_(bench, "UnitTester expect_true pass shown", none, [](UnitTester& test) {
+        return test.expect_true("pass", [] { return true; });
+      });
+      success &= measure_(bench, "UnitTester expect_true fail", none, [](UnitTester& test) {
+        return test.expect_true("fail", [] { return false; });
+      });
+      success &= measure_(bench, "UnitTester expect_value pass", quiet, [](UnitTester& test) {
+        return test.expect_value("pass", 42, [] { return 42; });
+      });
+      success &= measure_(bench, "UnitTester expect_value fail", none, [](UnitTester& test) {
+        return test.expect_value("fail", 42, [] { return 43; });
+      });
+      success &= measure_(bench, "UnitTester expect_in_range pass", quiet, [](UnitTester& test) {
+        return test.expect_in_range("pass", 1.0, 2.0, [] { return 1.5; });
+      });
+      success &= measure_(bench, "UnitTester expect_exception pass", quiet, [](UnitTester& test) {
+        return test.expect_exception<std::runtime_error>("pass", [] { throw std::runtime_error("expected"); });
+      });
+      success &= measure_(bench, "UnitTester namer pass", quiet, [](UnitTester& test) {
+        return test("pass").expect_true([] { return true; });
+      });
+      success &= measure_(bench, "UnitTester interned pass", [](UnitTester& test) { test.hide_pass().intern_ids(true); },
+        [](UnitTester& test) { return test.expect_true("pass", [] { return true; }); });
+      success &= measure_(bench, "UnitTester only_matching skipped",
+        [](UnitTester& test) { test.only_matching("parser *:lexer *"); },
+        [](UnitTester& test) { return test.expect_true("codegen emits", [] { return true; }); });
+      success &= measure_(bench, "UnitTester only_if pass",
+        [](UnitTester& test) { test.hide_pass().only_if([](std::string_view id) { return id.size() > 2; }); },
+        [](UnitTester& test) { return test.expect_true("pass", [] { return true; }); });
+      success &= measure_(bench, "UnitTester deferred 1000 passes", [](UnitTester& test) { test.hide_pass().deferred(); },
+        [](UnitTester& test) {
+          for (int i = 0; i < batch_size; ++i) test.expect_true("pass", [] { return true; });
+          return test.run(1);
+        });
+      success &= measure_(bench, "UnitTester reporter 1000 passes", none, [](UnitTester& test) {
+        for (int i = 0; i < batch_size; ++i) test.expect_true("pass", [] { return true; });
+        test.flush();
+        return true;
+      });
+      success &= measure_(bench, "UnitTester reporter 1000 passes batched",
+        [](UnitTester& test) { test.batch_size(256); },
+        [](UnitTester& test) {
+          for (int i = 0; i < batch_size; ++i) test.expect_true("pass", [] { return true; });
+          test.flush();
+          return true;
+        });
+      return success;
+    }
+};